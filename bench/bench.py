@@ -0,0 +1,284 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-or-later
+"""Benchmark nowforever_vfd against nowforever_sim.
+
+For each baud rate and period-seconds value the driver is loaded into HAL,
+talking to the simulator over a pseudo-terminal. The script toggles
+spindle-on and speed-command, and uses the frame log of the simulator to
+measure the time from each edge until the matching frame starts on the
+wire. It also reports transactions per second, the cycle-time
+distribution and the time until at-speed asserts, as JSON.
+
+It needs a LinuxCNC environment, with halcmd on PATH and the hal Python
+module importable. The hal module is only imported once a benchmark is
+started, so --help works without it.
+"""
+
+import argparse
+import json
+import os
+import random
+import shlex
+import subprocess
+import sys
+import tempfile
+import time
+
+COMP = "bench-vfd"
+MAX_FREQ = 400.0
+MAX_SPEED = 24000.0
+VFD_INSTRUCTION = 0x0900
+VFD_FREQUENCY = 0x0901
+STATE_CW = 1
+STATE_STOP = 0
+
+
+def halcmd(*args, check=True):
+    return subprocess.run(["halcmd"] + list(args), check=check,
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+
+def percentile(values, share):
+    """Nearest-rank percentile, None if there are no values."""
+    if not values:
+        return None
+    values = sorted(values)
+    rank = max(int(-(-share * len(values) // 1)), 1)
+    return values[min(rank, len(values)) - 1]
+
+
+def summary(values):
+    return {
+        "count": len(values),
+        "p50": percentile(values, 0.50),
+        "p99": percentile(values, 0.99),
+        "p999": percentile(values, 0.999),
+        "max": max(values) if values else None,
+    }
+
+
+def frame_writes(frame):
+    """Return the (register, value) pairs written by a request frame."""
+    function = frame[1]
+    if function == 0x06 and len(frame) == 8:
+        return [((frame[2] << 8) | frame[3], (frame[4] << 8) | frame[5])]
+    if function == 0x10 and len(frame) >= 9:
+        addr = (frame[2] << 8) | frame[3]
+        data = frame[7:-2]
+    elif function == 0x17 and len(frame) >= 13:
+        addr = (frame[6] << 8) | frame[7]
+        data = frame[11:-2]
+    else:
+        return []
+    return [(addr + i // 2, (data[i] << 8) | data[i + 1])
+            for i in range(0, len(data) - 1, 2)]
+
+
+def read_log(path):
+    """Return a list of (time, frame) from the simulator log."""
+    frames = []
+    with open(path) as log:
+        for line in log:
+            stamp, _, data = line.partition(" ")
+            frames.append((float(stamp), bytes.fromhex(data.strip())))
+    return frames
+
+
+def edge_latencies(edges, frames):
+    """Match each (time, register, value) edge to the first frame after it
+    that writes the value, and return the delays by register."""
+    latencies = {VFD_INSTRUCTION: [], VFD_FREQUENCY: []}
+    for stamp, register, value in edges:
+        for frame_time, frame in frames:
+            if frame_time >= stamp and (register, value) in frame_writes(frame):
+                latencies[register].append(frame_time - stamp)
+                break
+    return latencies
+
+
+def freq_value(speed):
+    return int(speed * MAX_FREQ / MAX_SPEED * 100)
+
+
+class Bench:
+    def __init__(self, args):
+        import hal
+
+        self.args = args
+        self.comp = hal.component("bench")
+        self.comp.newpin("spindle-on", hal.HAL_BIT, hal.HAL_OUT)
+        self.comp.newpin("spindle-fwd", hal.HAL_BIT, hal.HAL_OUT)
+        self.comp.newpin("speed-command", hal.HAL_FLOAT, hal.HAL_OUT)
+        self.comp.newpin("at-speed", hal.HAL_BIT, hal.HAL_IN)
+        self.comp.newpin("is-stopped", hal.HAL_BIT, hal.HAL_IN)
+        self.comp.newpin("cycle-time", hal.HAL_FLOAT, hal.HAL_IN)
+        self.comp.newpin("overruns", hal.HAL_S32, hal.HAL_IN)
+        self.comp.newpin("last-read-time", hal.HAL_FLOAT, hal.HAL_IN)
+        self.comp.ready()
+        self.cycle_times = []
+
+    def wait(self, seconds, until=None):
+        """Sample pins for up to @seconds, or until until() is true.
+        Return the time waited.
+
+        A cycle of the driver is seen by last-read-time moving on, so a
+        cycle-time equal to the one before is still sampled."""
+        start = time.monotonic()
+        last = None
+        while time.monotonic() - start < seconds:
+            cycle = (self.comp["last-read-time"], self.comp["cycle-time"])
+            if cycle != last:
+                self.cycle_times.append(cycle[1])
+                last = cycle
+            if until and until():
+                break
+            time.sleep(0.0005)
+        return time.monotonic() - start
+
+    def edge(self, pin, value):
+        stamp = time.monotonic()
+        self.comp[pin] = value
+        return stamp
+
+    def run(self, baud, period):
+        workdir = tempfile.mkdtemp(prefix="nowforever-bench-")
+        device = os.path.join(workdir, "vfd")
+        log = os.path.join(workdir, "frames.log")
+        sim = subprocess.Popen([self.args.sim, "--link", device,
+                                "--rate", str(baud), "--log", log,
+                                "--delay", str(self.args.delay)],
+                               stdout=subprocess.DEVNULL)
+        while not os.path.exists(device):
+            time.sleep(0.01)
+
+        halcmd("loadusr", "-Wn", COMP, self.args.driver, "-n", COMP,
+               "-d", device, "-r", str(baud), "-F", str(MAX_FREQ),
+               "-S", str(MAX_SPEED), *shlex.split(self.args.driver_args))
+        try:
+            halcmd("setp", COMP + ".period-seconds", str(period))
+            for pin in ("spindle-on", "spindle-fwd", "speed-command"):
+                halcmd("net", "bench-" + pin, "bench." + pin,
+                       COMP + "." + pin)
+            for pin in ("at-speed", "is-stopped", "cycle-time", "overruns",
+                        "last-read-time"):
+                halcmd("net", "bench-" + pin, COMP + "." + pin,
+                       "bench." + pin)
+            return self.measure(baud, period, log)
+        finally:
+            halcmd("unloadusr", COMP, check=False)
+            for pin in ("spindle-on", "spindle-fwd", "speed-command",
+                        "at-speed", "is-stopped", "cycle-time", "overruns",
+                        "last-read-time"):
+                halcmd("delsig", "bench-" + pin, check=False)
+            sim.terminate()
+            sim.wait()
+
+    def measure(self, baud, period, log):
+        comp = self.comp
+        self.cycle_times = []
+        comp["spindle-fwd"] = 1
+        comp["spindle-on"] = 0
+        comp["speed-command"] = 0
+        self.wait(1.0)
+
+        # Time to at-speed from standstill
+        at_speed = []
+        for _ in range(self.args.runups):
+            comp["spindle-on"] = 0
+            self.wait(30.0, lambda: comp["is-stopped"])
+            comp["speed-command"] = self.args.speed
+            self.edge("spindle-on", 1)
+            waited = self.wait(30.0, lambda: comp["at-speed"])
+            if comp["at-speed"]:
+                at_speed.append(waited)
+
+        # Edges, spaced randomly so they don't lock to the poll period
+        start = time.monotonic()
+        overruns = comp["overruns"]
+        edges = []
+        speed = self.args.speed
+        for i in range(self.args.edges):
+            if i % 2:
+                speed = self.args.speed if speed != self.args.speed \
+                    else self.args.speed * 1.01
+                edges.append((self.edge("speed-command", speed),
+                              VFD_FREQUENCY, freq_value(speed)))
+            else:
+                on = not comp["spindle-on"]
+                edges.append((self.edge("spindle-on", on), VFD_INSTRUCTION,
+                              STATE_CW if on else STATE_STOP))
+            self.wait(max(period, 0.005) * random.uniform(2.0, 4.0) +
+                      40 * 11.0 / baud)
+        duration = time.monotonic() - start
+        overruns = comp["overruns"] - overruns
+        comp["spindle-on"] = 0
+
+        frames = read_log(log)
+        latencies = edge_latencies(edges, frames)
+        transactions = sum(1 for stamp, _ in frames
+                           if start <= stamp < start + duration)
+        return {
+            "baud": baud,
+            "period": period,
+            "driver_args": self.args.driver_args,
+            "transactions_per_second": transactions / duration,
+            "cycle_time": dict(summary(self.cycle_times), overruns=overruns),
+            "latency": {
+                "spindle-on": summary(latencies[VFD_INSTRUCTION]),
+                "speed-command": summary(latencies[VFD_FREQUENCY]),
+                "missed": len(edges) - len(latencies[VFD_INSTRUCTION]) -
+                len(latencies[VFD_FREQUENCY]),
+            },
+            "at_speed": summary(at_speed),
+        }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--driver", default="./nowforever_vfd")
+    parser.add_argument("--sim", default="./nowforever_sim")
+    parser.add_argument("--driver-args", default="",
+                        help="more arguments for the driver, as in "
+                        "--driver-args=\"--threaded --native-rtu\"")
+    parser.add_argument("--bauds", default="2400,4800,9600,19200,38400",
+                        help="comma separated baud rates")
+    parser.add_argument("--periods", default="0.001,0.01,0.05",
+                        help="comma separated period-seconds values")
+    parser.add_argument("--edges", type=int, default=400,
+                        help="spindle-on and speed-command edges per run")
+    parser.add_argument("--runups", type=int, default=3,
+                        help="times to run up to speed per run")
+    parser.add_argument("--speed", type=float, default=6000.0,
+                        help="speed command in RPM")
+    parser.add_argument("--delay", type=float, default=0.002,
+                        help="response delay of the simulator in seconds")
+    parser.add_argument("--output", help="write JSON here, not to stdout")
+    args = parser.parse_args()
+
+    started = halcmd("-s", "show", "comp", check=False).returncode != 0
+    if started:
+        subprocess.run(["realtime", "start"], check=True)
+
+    results = []
+    try:
+        bench = Bench(args)
+        for baud in [int(b) for b in args.bauds.split(",")]:
+            for period in [float(p) for p in args.periods.split(",")]:
+                print("baud %d, period %g" % (baud, period), file=sys.stderr)
+                results.append(bench.run(baud, period))
+        bench.comp.exit()
+    finally:
+        if started:
+            subprocess.run(["realtime", "stop"])
+
+    output = json.dumps({"results": results}, indent=2)
+    if args.output:
+        with open(args.output, "w") as out:
+            out.write(output + "\n")
+    else:
+        print(output)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,845 @@
+/**
+ * @file nowforever_sim.c
+ * @brief Simulates Nowforever D100/E100 VFDs as Modbus RTU slaves on a
+ *        pseudo-terminal, so nowforever_vfd can be tested and benchmarked
+ *        without hardware.
+ */
+
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc16.h"
+
+
+/** Most drives that can be simulated on one bus. */
+#define MAX_DRIVES              31
+
+/** Address of first register the driver reads. */
+#define START_REGISTER_READ     0x0500
+
+/** Number of registers the driver reads. */
+#define NUM_REGISTER_READ       8
+
+/** Run, direction, jog and fault reset, written by the driver. */
+#define VFD_INSTRUCTION         0x0900
+
+/** Frequency in 0.01 Hz, written by the driver. */
+#define VFD_FREQUENCY           0x0901
+
+/** Largest Modbus RTU frame. */
+#define MAX_FRAME_SIZE          256
+
+/** Bits in the instruction register. */
+#define INSTRUCTION_RUN         1
+#define INSTRUCTION_REVERSE     2
+#define INSTRUCTION_FAULT_RESET 8
+
+/** Bits in the status register, 0x0500. */
+#define STATUS_RUN              1
+#define STATUS_REVERSE          2
+#define STATUS_FAULT            8
+
+/** Modbus function codes. */
+enum function_code {
+    FC_READ_REGISTERS = 0x03,
+    FC_WRITE_REGISTER = 0x06,
+    FC_WRITE_REGISTERS = 0x10,
+    FC_WRITE_AND_READ_REGISTERS = 0x17,
+};
+
+/** Modbus exception codes. */
+enum exception_code {
+    EX_ILLEGAL_FUNCTION = 0x01,
+    EX_ILLEGAL_ADDRESS = 0x02,
+    EX_ILLEGAL_VALUE = 0x03,
+    EX_BUSY = 0x06,
+};
+
+/** Behaviour of the simulated drives and bus. */
+struct sim_config {
+    double char_time;               /*!< time to send one character (s) */
+    double delay;                   /*!< time to answer a request (s) */
+    double drop_rate;               /*!< share of requests not answered */
+    double corrupt_rate;            /*!< share of answers with a bad CRC */
+    double busy_rate;               /*!< share of requests answered busy */
+    double accel;                   /*!< acceleration (Hz/s) */
+    double decel;                   /*!< deceleration (Hz/s) */
+    double max_freq;                /*!< maximum output frequency (Hz) */
+    double load;                    /*!< motor load at max frequency (%) */
+    double fault_at;                /*!< time of fault after start (s), or -1 */
+    int fc17;                       /*!< function 0x17 is supported */
+    int verbose;
+    FILE *log;                      /*!< log of received frames, or NULL */
+};
+
+/** State of one simulated drive. */
+struct drive {
+    int address;
+    uint16_t instruction;
+    uint16_t freq_ref;              /*!< frequency command (0.01 Hz) */
+    double freq_out;                /*!< output frequency (Hz) */
+    int reverse;                    /*!< running in reverse */
+    double accel;                   /*!< current change of frequency (Hz/s) */
+    double temp;                    /*!< heat sink temperature (C) */
+    int fault;
+    int fault_done;                 /*!< the fault at fault_at has happened */
+    struct timespec last_update;
+};
+
+static volatile sig_atomic_t done;
+static struct timespec start_time;
+
+static void quit(int sig)
+{
+    done = 1;
+}
+
+/** Add @p seconds to @p ts. */
+static void timespec_add(struct timespec *ts, double seconds)
+{
+    time_t sec = (time_t) seconds;
+
+    ts->tv_sec += sec;
+    ts->tv_nsec += (long) ((seconds - sec) * 1000000000l);
+    if (ts->tv_nsec >= 1000000000l) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000l;
+    }
+}
+
+/** Return @p a - @p b in seconds. */
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) * 1e-9;
+}
+
+/** Return a random number between 0 and 1. */
+static double random_share(void)
+{
+    return rand() / (RAND_MAX + 1.0);
+}
+
+/**
+ * @brief Move a drive forward to the current time.
+ *
+ * The output frequency ramps toward the command, a change of direction
+ * ramps down to zero first. A fault stops the output until it is reset.
+ *
+ * @param drive Drive to update.
+ * @param config Behaviour of the drives.
+ */
+static void update_drive(struct drive *drive, const struct sim_config *config)
+{
+    struct timespec now;
+    double dt, target, previous, load;
+    int run, reverse;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dt = timespec_diff(&now, &drive->last_update);
+    drive->last_update = now;
+
+    if (config->fault_at >= 0 && !drive->fault_done &&
+        timespec_diff(&now, &start_time) >= config->fault_at) {
+        drive->fault = 1;
+        drive->fault_done = 1;
+    }
+
+    run = (drive->instruction & INSTRUCTION_RUN) && !drive->fault;
+    reverse = (drive->instruction & INSTRUCTION_REVERSE) != 0;
+
+    target = run && reverse == drive->reverse ? drive->freq_ref * 0.01 : 0.0;
+    previous = drive->freq_out;
+    if (drive->freq_out < target)
+        drive->freq_out = fmin(drive->freq_out + config->accel * dt, target);
+    else
+        drive->freq_out = fmax(drive->freq_out - config->decel * dt, target);
+    if (drive->freq_out == 0.0)
+        drive->reverse = reverse;
+    drive->accel = dt > 0 ? (drive->freq_out - previous) / dt : 0.0;
+
+    /* The heat sink follows the load, with a time constant of a minute */
+    load = config->load * drive->freq_out / config->max_freq;
+    drive->temp += (30.0 + 0.4 * load - drive->temp) * fmin(dt / 60.0, 1.0);
+}
+
+/**
+ * @brief Read a register of a drive.
+ * @param drive Drive to read from.
+ * @param config Behaviour of the drives.
+ * @param addr Register address.
+ * @param value Value of the register.
+ * @return 0 on success, otherwise a Modbus exception code.
+ */
+static int read_register(const struct drive *drive,
+                         const struct sim_config *config, int addr,
+                         uint16_t *value)
+{
+    double share = drive->freq_out / config->max_freq;
+    double load;
+
+    /* Accelerating takes torque, decelerating feeds the DC bus */
+    load = config->load * share + (drive->accel > 0 ? 30.0 : 0.0);
+
+    switch (addr) {
+    case START_REGISTER_READ:
+        *value = (drive->fault ? STATUS_FAULT : 0) |
+                 (drive->reverse ? STATUS_REVERSE : 0) |
+                 (drive->freq_out > 0 ||
+                  ((drive->instruction & INSTRUCTION_RUN) && !drive->fault) ?
+                  STATUS_RUN : 0);
+        break;
+    case START_REGISTER_READ + 1:
+        *value = drive->freq_ref;
+        break;
+    case START_REGISTER_READ + 2:
+        *value = (uint16_t) lround(drive->freq_out * 100);
+        break;
+    case START_REGISTER_READ + 3:
+        *value = drive->freq_out > 0 ? (uint16_t) lround(8 + 0.7 * load) : 0;
+        break;
+    case START_REGISTER_READ + 4:
+        *value = (uint16_t) lround(2200 * share);
+        break;
+    case START_REGISTER_READ + 5:
+        *value = drive->accel < 0 ? 340 : 310;
+        break;
+    case START_REGISTER_READ + 6:
+        *value = drive->freq_out > 0 ? (uint16_t) lround(load * 10) : 0;
+        break;
+    case START_REGISTER_READ + 7:
+        *value = (uint16_t) lround(drive->temp);
+        break;
+    case VFD_INSTRUCTION:
+        *value = drive->instruction;
+        break;
+    case VFD_FREQUENCY:
+        *value = drive->freq_ref;
+        break;
+    default:
+        return EX_ILLEGAL_ADDRESS;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check that a register can be written.
+ * @return 0 if it can, otherwise a Modbus exception code.
+ */
+static int check_write(const struct sim_config *config, int addr,
+                       uint16_t value)
+{
+    if (addr != VFD_INSTRUCTION && addr != VFD_FREQUENCY)
+        return EX_ILLEGAL_ADDRESS;
+    if (addr == VFD_FREQUENCY && value > config->max_freq * 100)
+        return EX_ILLEGAL_VALUE;
+    return 0;
+}
+
+/** Write a register of a drive, check_write() must have accepted it. */
+static void write_register(struct drive *drive, int addr, uint16_t value)
+{
+    if (addr == VFD_FREQUENCY) {
+        drive->freq_ref = value;
+        return;
+    }
+
+    drive->instruction = value & ~INSTRUCTION_FAULT_RESET;
+    if (value & INSTRUCTION_FAULT_RESET)
+        drive->fault = 0;
+}
+
+/** Get big endian 16 bit value at @p p. */
+static int get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/** Store @p value big endian at @p p. */
+static void put16(uint8_t *p, int value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+/**
+ * @brief Carry out a request on one drive.
+ *
+ * @param drive Drive the request is for.
+ * @param config Behaviour of the drives.
+ * @param req Request, without CRC.
+ * @param len Length of request.
+ * @param rsp Answer, without CRC.
+ * @return Length of answer.
+ */
+static int handle_request(struct drive *drive, const struct sim_config *config,
+                          const uint8_t *req, int len, uint8_t *rsp)
+{
+    int function = req[1];
+    int addr, nb, waddr, wnb, i, exception = 0;
+    uint16_t value;
+
+    rsp[0] = req[0];
+    rsp[1] = function;
+
+    switch (function) {
+    case FC_READ_REGISTERS:
+        if (len != 6) {
+            exception = EX_ILLEGAL_VALUE;
+            break;
+        }
+        addr = get16(&req[2]);
+        nb = get16(&req[4]);
+        if (nb < 1 || nb > 125) {
+            exception = EX_ILLEGAL_VALUE;
+            break;
+        }
+        rsp[2] = 2 * nb;
+        for (i = 0; i < nb && !exception; i++) {
+            exception = read_register(drive, config, addr + i, &value);
+            put16(&rsp[3 + 2 * i], value);
+        }
+        if (!exception)
+            return 3 + 2 * nb;
+        break;
+    case FC_WRITE_REGISTER:
+        if (len != 6) {
+            exception = EX_ILLEGAL_VALUE;
+            break;
+        }
+        addr = get16(&req[2]);
+        value = get16(&req[4]);
+        exception = check_write(config, addr, value);
+        if (!exception) {
+            write_register(drive, addr, value);
+            memcpy(&rsp[2], &req[2], 4);
+            return 6;
+        }
+        break;
+    case FC_WRITE_REGISTERS:
+        addr = get16(&req[2]);
+        nb = get16(&req[4]);
+        if (nb < 1 || nb > 123 || len != 7 + 2 * nb || req[6] != 2 * nb) {
+            exception = EX_ILLEGAL_VALUE;
+            break;
+        }
+        for (i = 0; i < nb && !exception; i++)
+            exception = check_write(config, addr + i, get16(&req[7 + 2 * i]));
+        if (exception)
+            break;
+        for (i = 0; i < nb; i++)
+            write_register(drive, addr + i, get16(&req[7 + 2 * i]));
+        memcpy(&rsp[2], &req[2], 4);
+        return 6;
+    case FC_WRITE_AND_READ_REGISTERS:
+        if (!config->fc17) {
+            exception = EX_ILLEGAL_FUNCTION;
+            break;
+        }
+        addr = get16(&req[2]);
+        nb = get16(&req[4]);
+        waddr = get16(&req[6]);
+        wnb = get16(&req[8]);
+        if (nb < 1 || nb > 125 || wnb < 1 || wnb > 121 ||
+            len != 11 + 2 * wnb || req[10] != 2 * wnb) {
+            exception = EX_ILLEGAL_VALUE;
+            break;
+        }
+        for (i = 0; i < wnb && !exception; i++)
+            exception = check_write(config, waddr + i, get16(&req[11 + 2 * i]));
+        if (exception)
+            break;
+        /* The write is done before the read */
+        for (i = 0; i < wnb; i++)
+            write_register(drive, waddr + i, get16(&req[11 + 2 * i]));
+        rsp[2] = 2 * nb;
+        for (i = 0; i < nb && !exception; i++) {
+            exception = read_register(drive, config, addr + i, &value);
+            put16(&rsp[3 + 2 * i], value);
+        }
+        if (!exception)
+            return 3 + 2 * nb;
+        break;
+    default:
+        exception = EX_ILLEGAL_FUNCTION;
+        break;
+    }
+
+    rsp[1] = function | 0x80;
+    rsp[2] = exception;
+    return 3;
+}
+
+/**
+ * @brief Log a frame from the master.
+ *
+ * Each line holds the CLOCK_MONOTONIC time the frame started to arrive,
+ * and the frame in hex, for scripts that measure the driver.
+ *
+ * @param log Log file.
+ * @param frame Frame from the master.
+ * @param len Length of frame.
+ * @param received Time the first byte was received.
+ */
+static void log_frame(FILE *log, const uint8_t *frame, int len,
+                      const struct timespec *received)
+{
+    int i;
+
+    fprintf(log, "%ld.%09ld ", (long) received->tv_sec, received->tv_nsec);
+    for (i = 0; i < len; i++)
+        fprintf(log, "%02x", frame[i]);
+    fprintf(log, "\n");
+    fflush(log);
+}
+
+/**
+ * @brief Receive one frame from the master.
+ *
+ * A frame ends when the line has been silent for 3.5 characters.
+ *
+ * @param fd Master side of the pseudo-terminal.
+ * @param config Behaviour of the bus.
+ * @param frame Room for @c MAX_FRAME_SIZE bytes.
+ * @param received Time the first byte was received.
+ * @return Length of frame, 0 if nothing was received, -1 on error.
+ */
+static int receive_frame(int fd, const struct sim_config *config,
+                         uint8_t *frame, struct timespec *received)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int silence_ms = (int) ceil(fmax(3.5 * config->char_time, 0.00175) * 1000);
+    int len = 0;
+    ssize_t n;
+
+    /* Wake up now and then, to check if we should quit */
+    if (poll(&pfd, 1, 100) <= 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, received);
+
+    do {
+        n = read(fd, frame + len, MAX_FRAME_SIZE - len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            /* Nobody has the slave side open, wait for them */
+            if (errno == EIO) {
+                usleep(100000);
+                return 0;
+            }
+            return -1;
+        }
+        len += n;
+    } while (len < MAX_FRAME_SIZE && poll(&pfd, 1, silence_ms) > 0);
+
+    return len;
+}
+
+/**
+ * @brief Answer a frame from the master.
+ *
+ * The pseudo-terminal passes bytes on at once, so the time the frames
+ * would spend on the wire is added before the answer is sent.
+ *
+ * @param fd Master side of the pseudo-terminal.
+ * @param drives Simulated drives.
+ * @param num_drives Number of drives.
+ * @param config Behaviour of the drives and bus.
+ * @param req Frame from the master.
+ * @param len Length of frame.
+ * @param received Time the first byte was received.
+ */
+static void handle_frame(int fd, struct drive *drives, int num_drives,
+                         const struct sim_config *config, const uint8_t *req,
+                         int len, const struct timespec *received)
+{
+    uint8_t rsp[MAX_FRAME_SIZE];
+    struct drive *drive = NULL;
+    struct timespec reply_at;
+    uint16_t crc;
+    int i, rsp_len;
+
+    if (len < 4 || crc16(req, len - 2) != (req[len - 2] | (req[len - 1] << 8))) {
+        if (config->verbose)
+            fprintf(stderr, "nowforever_sim: dropped bad frame of %d bytes\n",
+                    len);
+        return;
+    }
+
+    /* A broadcast is carried out by all drives, and answered by none */
+    if (req[0] == 0) {
+        for (i = 0; i < num_drives; i++) {
+            update_drive(&drives[i], config);
+            if (req[1] != FC_READ_REGISTERS)
+                handle_request(&drives[i], config, req, len - 2, rsp);
+        }
+        if (config->verbose)
+            fprintf(stderr, "nowforever_sim: broadcast function 0x%02x\n",
+                    req[1]);
+        return;
+    }
+
+    for (i = 0; i < num_drives; i++) {
+        if (drives[i].address == req[0])
+            drive = &drives[i];
+    }
+    if (!drive)
+        return;
+
+    if (random_share() < config->drop_rate) {
+        if (config->verbose)
+            fprintf(stderr, "nowforever_sim: %d: not answering\n", req[0]);
+        return;
+    }
+
+    update_drive(drive, config);
+    if (random_share() < config->busy_rate) {
+        rsp[0] = req[0];
+        rsp[1] = req[1] | 0x80;
+        rsp[2] = EX_BUSY;
+        rsp_len = 3;
+    } else {
+        rsp_len = handle_request(drive, config, req, len - 2, rsp);
+    }
+
+    crc = crc16(rsp, rsp_len);
+    if (random_share() < config->corrupt_rate)
+        crc ^= 0x5A5A;
+    rsp[rsp_len++] = crc & 0xFF;
+    rsp[rsp_len++] = crc >> 8;
+
+    /* The request is on the wire, the drive works, then the answer is */
+    reply_at = *received;
+    timespec_add(&reply_at, (len + rsp_len) * config->char_time + config->delay);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &reply_at, NULL);
+
+    if (write(fd, rsp, rsp_len) != rsp_len)
+        fprintf(stderr, "nowforever_sim: ERROR writing answer: %s\n",
+                strerror(errno));
+
+    if (config->verbose)
+        fprintf(stderr, "nowforever_sim: %d: function 0x%02x, %d bytes in, %d bytes out%s\n",
+                req[0], req[1], len, rsp_len, rsp[1] & 0x80 ? ", exception" : "");
+}
+
+/**
+ * @brief Open a pseudo-terminal.
+ *
+ * The slave side is kept open, so the master side stays usable while the
+ * driver closes and opens it again.
+ *
+ * @param slave_fd Slave side, set to raw mode.
+ * @return Master side, or -1 on failure.
+ */
+static int open_pty(int *slave_fd)
+{
+    struct termios tios;
+    int fd;
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+        fprintf(stderr, "nowforever_sim: ERROR: unable to open pseudo-terminal: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    *slave_fd = open(ptsname(fd), O_RDWR | O_NOCTTY);
+    if (*slave_fd < 0 || tcgetattr(*slave_fd, &tios) != 0) {
+        fprintf(stderr, "nowforever_sim: ERROR: unable to open %s: %s\n",
+                ptsname(fd), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tios);
+    tcsetattr(*slave_fd, TCSANOW, &tios);
+    return fd;
+}
+
+static const char *option_string = "a:r:p:l:F:vh";
+enum {
+    OPT_DELAY = 256,
+    OPT_DROP_RATE,
+    OPT_CORRUPT_RATE,
+    OPT_BUSY_RATE,
+    OPT_ACCEL,
+    OPT_DECEL,
+    OPT_LOAD,
+    OPT_FAULT_AT,
+    OPT_NO_FC17,
+    OPT_LOG,
+};
+static struct option long_options[] = {
+    {"address", 1, 0, 'a'},
+    {"rate", 1, 0, 'r'},
+    {"parity", 1, 0, 'p'},
+    {"link", 1, 0, 'l'},
+    {"max-frequency", 1, 0, 'F'},
+    {"verbose", 0, 0, 'v'},
+    {"help", 0, 0, 'h'},
+    {"delay", 1, 0, OPT_DELAY},
+    {"drop-rate", 1, 0, OPT_DROP_RATE},
+    {"corrupt-rate", 1, 0, OPT_CORRUPT_RATE},
+    {"busy-rate", 1, 0, OPT_BUSY_RATE},
+    {"accel", 1, 0, OPT_ACCEL},
+    {"decel", 1, 0, OPT_DECEL},
+    {"load", 1, 0, OPT_LOAD},
+    {"fault-at", 1, 0, OPT_FAULT_AT},
+    {"no-fc17", 0, 0, OPT_NO_FC17},
+    {"log", 1, 0, OPT_LOG},
+    {0,0,0,0}
+};
+
+static void usage(char **argv)
+{
+    printf("Usage: %s [ARGUMENTS]\n", argv[0]);
+    printf("\n");
+    printf("Simulates Nowforever D100/E100 VFDs as Modbus RTU slaves on a pseudo-terminal.\n");
+    printf("Point nowforever_vfd -d at the printed device, or at --link.\n");
+    printf("\n");
+    printf("Optional arguments:\n");
+    printf("   -a, --address <n> (default: 1)\n");
+    printf("       Modbus address of a simulated VFD. Give it once for each VFD.\n");
+    printf("   -r, --rate <n> (default: 19200)\n");
+    printf("       Baud rate to emulate, frames are delayed by their time on the wire.\n");
+    printf("   -p, --parity {even,odd,none} (default: none)\n");
+    printf("       Parity to emulate, it adds one bit to each character.\n");
+    printf("   -l, --link <path>\n");
+    printf("       Create a symbolic link to the pseudo-terminal at <path>.\n");
+    printf("   -F, --max-frequency <f> (default: 400.0)\n");
+    printf("       Maximum output frequency in Hz.\n");
+    printf("   --delay <f> (default: 0.002)\n");
+    printf("       Seconds a VFD takes to answer, after the request is received.\n");
+    printf("   --drop-rate <f> (default: 0)\n");
+    printf("       Share of requests, from 0 to 1, that are not answered.\n");
+    printf("   --corrupt-rate <f> (default: 0)\n");
+    printf("       Share of answers, from 0 to 1, sent with a bad CRC.\n");
+    printf("   --busy-rate <f> (default: 0)\n");
+    printf("       Share of requests, from 0 to 1, answered with exception 0x06, busy.\n");
+    printf("   --accel <f> (default: 100.0)\n");
+    printf("       Acceleration in Hz per second.\n");
+    printf("   --decel <f> (default: 100.0)\n");
+    printf("       Deceleration in Hz per second.\n");
+    printf("   --load <f> (default: 40.0)\n");
+    printf("       Motor load in percent at max frequency, 30 percent is added while\n");
+    printf("       accelerating.\n");
+    printf("   --fault-at <f>\n");
+    printf("       Trip all VFDs <f> seconds after start. The fault is reset by writing\n");
+    printf("       bit 3 of register 0x0900.\n");
+    printf("   --no-fc17\n");
+    printf("       Answer Modbus function 0x17 with exception 0x01, illegal function.\n");
+    printf("   --log <path>\n");
+    printf("       Log the time and contents of each received frame to <path>.\n");
+    printf("   -v, --verbose\n");
+    printf("       Print each transaction.\n");
+    printf("   -h, --help\n");
+    printf("       Show this help.\n");
+}
+
+/**
+ * @brief Parse a floating point option.
+ * @return 0 on success, -1 if @p arg isn't a number between @p min and
+ *         @p max.
+ */
+static int parse_double(const char *arg, double min, double max, double *value)
+{
+    char *endarg;
+
+    *value = strtod(arg, &endarg);
+    if (*endarg != '\0' || *value < min || *value > max) {
+        fprintf(stderr, "nowforever_sim: ERROR: invalid value: %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct sim_config config;
+    struct drive drives[MAX_DRIVES];
+    struct timespec received;
+    uint8_t frame[MAX_FRAME_SIZE];
+    const char *link_path = NULL;
+    int num_drives = 0;
+    int baud = 19200;
+    int parity_bits = 0;
+    int master_fd, slave_fd;
+    int opt, len, i;
+    double value;
+    char *endarg;
+
+    memset(&config, 0, sizeof(config));
+    memset(drives, 0, sizeof(drives));
+    config.delay = 0.002;
+    config.accel = 100.0;
+    config.decel = 100.0;
+    config.max_freq = 400.0;
+    config.load = 40.0;
+    config.fault_at = -1;
+    config.fc17 = 1;
+
+    while ((opt = getopt_long(argc, argv, option_string, long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'a':
+            i = strtol(optarg, &endarg, 10);
+            if (*endarg != '\0' || i < 1 || i > 247 || num_drives == MAX_DRIVES) {
+                fprintf(stderr, "nowforever_sim: ERROR: invalid address: %s\n",
+                        optarg);
+                exit(1);
+            }
+            drives[num_drives++].address = i;
+            break;
+        case 'r':
+            baud = strtol(optarg, &endarg, 10);
+            if (*endarg != '\0' || baud < 300) {
+                fprintf(stderr, "nowforever_sim: ERROR: invalid baud rate: %s\n",
+                        optarg);
+                exit(1);
+            }
+            break;
+        case 'p':
+            if (strcmp(optarg, "none") == 0) {
+                parity_bits = 0;
+            } else if (strcmp(optarg, "even") == 0 || strcmp(optarg, "odd") == 0) {
+                parity_bits = 1;
+            } else {
+                fprintf(stderr, "nowforever_sim: ERROR: invalid parity: %s\n",
+                        optarg);
+                exit(1);
+            }
+            break;
+        case 'l':
+            link_path = optarg;
+            break;
+        case 'F':
+            if (parse_double(optarg, 1.0, 650.0, &config.max_freq))
+                exit(1);
+            break;
+        case 'v':
+            config.verbose = 1;
+            break;
+        case OPT_DELAY:
+            if (parse_double(optarg, 0.0, 10.0, &config.delay))
+                exit(1);
+            break;
+        case OPT_DROP_RATE:
+            if (parse_double(optarg, 0.0, 1.0, &config.drop_rate))
+                exit(1);
+            break;
+        case OPT_CORRUPT_RATE:
+            if (parse_double(optarg, 0.0, 1.0, &config.corrupt_rate))
+                exit(1);
+            break;
+        case OPT_BUSY_RATE:
+            if (parse_double(optarg, 0.0, 1.0, &config.busy_rate))
+                exit(1);
+            break;
+        case OPT_ACCEL:
+            if (parse_double(optarg, 0.1, 10000.0, &config.accel))
+                exit(1);
+            break;
+        case OPT_DECEL:
+            if (parse_double(optarg, 0.1, 10000.0, &config.decel))
+                exit(1);
+            break;
+        case OPT_LOAD:
+            if (parse_double(optarg, 0.0, 150.0, &config.load))
+                exit(1);
+            break;
+        case OPT_FAULT_AT:
+            if (parse_double(optarg, 0.0, 1e6, &value))
+                exit(1);
+            config.fault_at = value;
+            break;
+        case OPT_NO_FC17:
+            config.fc17 = 0;
+            break;
+        case OPT_LOG:
+            config.log = fopen(optarg, "w");
+            if (!config.log) {
+                fprintf(stderr, "nowforever_sim: ERROR: unable to open %s: %s\n",
+                        optarg, strerror(errno));
+                exit(1);
+            }
+            break;
+        case 'h':
+            usage(argv);
+            exit(0);
+            break;
+        default:
+            usage(argv);
+            exit(1);
+            break;
+        }
+    }
+
+    if (num_drives == 0)
+        drives[num_drives++].address = 1;
+
+    /* Start bit, 8 data bits, parity bit and stop bit */
+    config.char_time = (10 + parity_bits) / (double) baud;
+
+    srand(time(NULL));
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (i = 0; i < num_drives; i++) {
+        drives[i].last_update = start_time;
+        drives[i].temp = 30.0;
+    }
+
+    master_fd = open_pty(&slave_fd);
+    if (master_fd < 0)
+        exit(1);
+
+    if (link_path) {
+        unlink(link_path);
+        if (symlink(ptsname(master_fd), link_path) != 0) {
+            fprintf(stderr, "nowforever_sim: ERROR: unable to create link %s: %s\n",
+                    link_path, strerror(errno));
+            exit(1);
+        }
+    }
+
+    signal(SIGINT, quit);
+    signal(SIGTERM, quit);
+
+    printf("nowforever_sim: %s, %d baud, %d VFD%s\n", ptsname(master_fd), baud,
+           num_drives, num_drives > 1 ? "s" : "");
+    fflush(stdout);
+
+    while (!done) {
+        len = receive_frame(master_fd, &config, frame, &received);
+        if (len < 0) {
+            fprintf(stderr, "nowforever_sim: ERROR reading: %s\n",
+                    strerror(errno));
+            break;
+        }
+        if (len > 0 && config.log)
+            log_frame(config.log, frame, len, &received);
+        if (len > 0)
+            handle_frame(master_fd, drives, num_drives, &config, frame, len,
+                         &received);
+    }
+
+    if (link_path)
+        unlink(link_path);
+    if (config.log)
+        fclose(config.log);
+    close(slave_fd);
+    close(master_fd);
+    return 0;
+}
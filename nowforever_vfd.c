@@ -11,31 +11,92 @@
  * Based on other drivers found in the LinuxCNC repository.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <getopt.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/serial.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include <modbus.h>
 
 #include "hal.h"
 #include "rtapi.h"
 
+#include "crc16.h"
 
-/** If a modbus transaction fails, retry this many times before giving up. */
-#define NUM_MODBUS_RETRIES 5
 
-/** Address of register to read from. */
-#define START_REGISTER_READ     0x0500
+/** Default number of retries for a failed read, before waiting for next cycle. */
+#define NUM_READ_RETRIES 2
 
-/** Number of registers to read */
-#define NUM_REGISTER_READ       8
+/** Default number of retries for a failed write, before waiting for next cycle. */
+#define NUM_WRITE_RETRIES 5
+
+/** Default delay before first retry (s), doubled for each retry. */
+#define RETRY_DELAY 0.02
+
+/** Default number of failed transactions in a row, before giving up on vfd. */
+#define BREAKER_THRESHOLD 10
+
+/** Failed function 0x17 probes in a row, while the plain write succeeds,
+ *  before combined mode is given up on. */
+#define COMBINED_RW_PROBES 3
+
+/** Default time between probes, while the vfd doesn't respond (s). */
+#define PROBE_PERIOD 1.0
+
+/** Longest wait for each vfd to acknowledge the stop, on exit (s). */
+#define STOP_TIMEOUT 0.2
+
+/** Time between attempts to reopen a lost serial port (s). */
+#define RECONNECT_PERIOD 0.5
+
+/** Directory of links to USB serial ports, named after the adapter. */
+#define SERIAL_BY_ID "/dev/serial/by-id"
+
+/** Turnaround to assume, if the vfd doesn't answer on startup (s). */
+#define DEFAULT_TURNAROUND 0.05
+
+/** Number of reads timed, when measuring the turnaround of the vfd. */
+#define NUM_TURNAROUND_SAMPLES 5
+
+/** Added to the computed timeouts, to cover scheduling delays (s). */
+#define TIMEOUT_SLACK 0.005
+
+/** Drive status register, see VFD_INSTRUCTION for the bits. */
+#define VFD_STATUS              0x0500
+
+/** Output frequency in 0.01 Hz steps */
+#define VFD_OUTPUT_FREQ         0x0502
+
+/** Most vfds that can share a serial bus, Modbus addresses are 1 - 31. */
+#define MAX_VFDS 31
+
+/** Most serial buses one process can service. */
+#define MAX_BUSES 8
+
+/** Longest pin or parameter name after the name of a vfd. */
+#define LONGEST_PIN_SUFFIX ".max-extrapolation-seconds"
 
 /**
  * Bit 0: 1 = run, 0 = stop @n
@@ -48,6 +109,30 @@
 /** Write frequency in 0.01 Hz steps */
 #define VFD_FREQUENCY           0x0901
 
+/** Number of writable registers, starting at VFD_INSTRUCTION */
+#define NUM_REGISTER_WRITE      2
+
+/** Size in bytes of a request to read registers. */
+#define READ_REQUEST_SIZE       8
+
+/** Size in bytes of the answer when reading @p nb registers. */
+#define READ_RESPONSE_SIZE(nb)  (5 + 2 * (nb))
+
+/** Size in bytes of a request to write @p nb registers. */
+#define WRITE_REQUEST_SIZE(nb)  (9 + 2 * (nb))
+
+/** Size in bytes of the largest request, write and read registers. */
+#define MAX_REQUEST_SIZE        (13 + 2 * NUM_REGISTER_WRITE)
+
+/** Size in bytes of the answer when writing registers. */
+#define WRITE_RESPONSE_SIZE     8
+
+/** Size in bytes of an exception answer. */
+#define EXCEPTION_RESPONSE_SIZE 5
+
+/** Shortest silence between frames (s), used above 19200 baud. */
+#define MIN_FRAME_SILENCE       0.00175
+
 /** Running states the vfd can be in. */
 enum vfd_state {
     VFD_STOP = 0,
@@ -55,6 +140,117 @@ enum vfd_state {
     VFD_CCW = 3,
 };
 
+/** Support for Modbus function 0x17, write and read registers. */
+enum combined_rw {
+    COMBINED_RW_OFF,        /*!< Not requested, or not supported by vfd */
+    COMBINED_RW_PROBE,      /*!< Not yet known if vfd supports it */
+    COMBINED_RW_ON,
+};
+
+/** Operations on the vfd, with separate retry budgets. */
+enum vfd_op {
+    OP_READ,                /*!< read fast group */
+    OP_READ_SLOW,           /*!< read slow group */
+    OP_WRITE,               /*!< write state and frequency */
+    NUM_OPS,
+};
+
+/** State of the circuit breaker, which stops traffic to a dead vfd. */
+enum breaker_state {
+    BREAKER_CLOSED,         /*!< normal traffic */
+    BREAKER_HALF_OPEN,      /*!< probe answered, one failure opens again */
+    BREAKER_OPEN,           /*!< only probes are sent */
+};
+
+/** Why loop_timer_sleep() returned. */
+enum wakeup {
+    WAKEUP_DEADLINE,        /*!< start of next cycle */
+    WAKEUP_EVENT,           /*!< new commands, in event driven mode */
+    WAKEUP_TIMEOUT,         /*!< a retry or probe is due */
+    WAKEUP_STOP,            /*!< the driver is asked to exit */
+};
+
+/** How the direction of the RS485 transceiver is switched. */
+enum rs485_mode {
+    RS485_NONE,             /*!< by the adapter itself */
+    RS485_KERNEL,           /*!< by the serial driver, with TIOCSRS485 */
+    RS485_RTS_UP,           /*!< RTS is raised while sending */
+    RS485_RTS_DOWN,         /*!< RTS is lowered while sending */
+};
+
+/** State of the serial port of a bus. */
+enum port_state {
+    PORT_OPEN,              /*!< normal traffic */
+    PORT_LOST,              /*!< a transaction found the device gone */
+    PORT_CLOSED,            /*!< closed, reopened every RECONNECT_PERIOD */
+};
+
+/** Kinds of transactions, with separate latency statistics. */
+enum latency_type {
+    LATENCY_READ,
+    LATENCY_STATE_WRITE,
+    LATENCY_FREQ_WRITE,
+    LATENCY_TURNAROUND,     /*!< reads, less the time on the wire */
+    NUM_LATENCY_TYPES,
+};
+
+/** Number of buckets in the latency histograms. */
+#define NUM_LATENCY_BUCKETS 8
+
+/** Upper limit of each histogram bucket (s), the last bucket has none. */
+static const double latency_bucket_limits[NUM_LATENCY_BUCKETS - 1] = {
+    0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1,
+};
+
+/** Name of each kind of transaction, used in pin names. */
+static const char *latency_names[NUM_LATENCY_TYPES] = {
+    "read", "state-write", "freq-write", "turnaround",
+};
+
+/** Weight of the newest latency in the moving average. */
+#define LATENCY_EWMA_WEIGHT 0.1
+
+/** Weight of the newest sample in the learned ramp rates. */
+#define RAMP_EWMA_WEIGHT 0.3
+
+/** Output frequency below which the vfd is taken as stopped, for the ramp
+ *  model (Hz). */
+#define RAMP_MIN_FREQ 0.5
+
+/** Latency pins for one kind of transaction. */
+struct latency_pins {
+    hal_float_t *last;
+    hal_float_t *min;
+    hal_float_t *max;
+    hal_float_t *avg;               /*!< exponential moving average */
+    hal_s32_t   *count;
+    hal_s32_t   *histogram[NUM_LATENCY_BUCKETS];
+};
+
+/** Pins shared by all vfds, in broadcast mode */
+struct hal_group {
+    hal_bit_t   *spindle_on;
+    hal_bit_t   *spindle_fwd;
+    hal_bit_t   *spindle_rev;
+    hal_bit_t   *confirmed;         /*!< all vfds report the new state */
+};
+
+/**
+ * Ramp of the output frequency, learned from the samples read from the
+ * vfd. Owned by whoever services the HAL pins. Frequencies are signed,
+ * negative in reverse.
+ */
+struct ramp_model {
+    double accel;                   /*!< learned acceleration (Hz/s), or 0 */
+    double decel;                   /*!< learned deceleration (Hz/s), or 0 */
+    double freq;                    /*!< last sample (Hz) */
+    double time;                    /*!< CLOCK_MONOTONIC of last sample (s) */
+    double change;                  /*!< change of speed over last interval */
+    double slope;                   /*!< change of freq over last interval (Hz/s) */
+    double target;                  /*!< commanded frequency (Hz) */
+    double target_time;             /*!< CLOCK_MONOTONIC of last change (s) */
+};
+
 /** Signals, pins and parameters from LinuxCNC and HAL */
 struct haldata {
     /* Information acquired from vfd */
@@ -70,6 +266,12 @@ struct haldata {
     hal_bit_t   *at_speed;
     hal_bit_t   *is_stopped;
     hal_float_t *speed_fb;
+    hal_float_t *read_time;         /*!< CLOCK_MONOTONIC of last good read (s) */
+    hal_float_t *telemetry_age;     /*!< time since last good read (s) */
+    hal_bit_t   *telemetry_stale;   /*!< telemetry_age is above stale_limit */
+    hal_bit_t   *predicted_at_speed;    /*!< at speed, by the ramp model */
+    hal_float_t *time_to_at_speed;  /*!< by the ramp model (s), or -1 */
+    struct ramp_model ramp;
 
     /* Commands from LinuxCNC */
     hal_bit_t   *spindle_on;
@@ -77,196 +279,3095 @@ struct haldata {
     hal_bit_t   *spindle_rev;
     hal_float_t *speed_cmd;
 
+    /* Statistics */
+    hal_s32_t   *suppressed_writes; /*!< writes skipped by the shadow copy */
+    hal_float_t *cycle_time;        /*!< time between start of cycles (s) */
+    hal_float_t *max_cycle_time;    /*!< longest cycle time (s) */
+    hal_s32_t   *overruns;          /*!< cycles that didn't finish in time */
+    hal_float_t *wakeup_jitter;     /*!< time the cycle started late (s) */
+    hal_float_t *max_wakeup_jitter;
+    hal_s32_t   *breaker_state;     /*!< enum breaker_state */
+    hal_bit_t   *comm_ok;           /*!< port open, and vfd answering */
+    struct latency_pins latency[NUM_LATENCY_TYPES];
+    hal_bit_t   *reset_stats;       /*!< cleared when statistics are reset */
+    unsigned int reset_count;       /*!< times reset_stats has been set */
+    struct hal_group *group;        /*!< in broadcast mode, otherwise NULL */
+
     /* Parameters */
     hal_float_t speed_tolerance;
     hal_float_t period;
+    hal_float_t slow_period;
+    hal_float_t hal_period;
+    hal_float_t response_timeout;
+    hal_float_t byte_timeout;
+    hal_float_t turnaround;
+    hal_float_t stale_limit;        /*!< longest telemetry age, or 0 (s) */
+    hal_float_t max_extrapolation;  /*!< of speed feedback, or 0 (s) */
+    hal_float_t accel;              /*!< learned by ramp model (Hz/s) */
+    hal_float_t decel;
     hal_s32_t   modbus_errors;
 };
 
-static int done;
-char *modname = "nowforever_vfd";
+/** When a register is read, unless --fast-registers says otherwise. */
+enum poll_group {
+    POLL_FAST,              /*!< every period */
+    POLL_SLOW,              /*!< every slow period */
+};
+
+/** Register read from the vfd, and the HAL pin it is published on. */
+struct register_def {
+    int addr;
+    hal_type_t type;                /*!< HAL_FLOAT or HAL_S32 */
+    double scale;                   /*!< value of one count, for HAL_FLOAT */
+    const char *pin;                /*!< pin name, after the prefix */
+    hal_pin_dir_t dir;
+    enum poll_group group;
+    size_t field;                   /*!< offset of the pin in struct haldata */
+};
+
+#define REGISTER_PIN(name) offsetof(struct haldata, name)
 
-static int read_data(modbus_t *mb_ctx, struct haldata *hal_data_block)
+/**
+ * Registers read from the vfd, sorted by address. Registers at consecutive
+ * addresses are read in one transaction, so a register added next to the
+ * others doesn't cost another transaction.
+ */
+static const struct register_def registers[] = {
+    { VFD_STATUS, HAL_S32,   1,    "inverter-status",   HAL_OUT, POLL_FAST,
+      REGISTER_PIN(inverter_status) },
+    { 0x0501,     HAL_FLOAT, 0.01, "frequency-command", HAL_OUT, POLL_FAST,
+      REGISTER_PIN(freq_cmd) },
+    { VFD_OUTPUT_FREQ, HAL_FLOAT, 0.01, "frequency-out", HAL_OUT, POLL_FAST,
+      REGISTER_PIN(output_freq) },
+    { 0x0503,     HAL_FLOAT, 0.1,  "output-current",    HAL_OUT, POLL_FAST,
+      REGISTER_PIN(output_current) },
+    { 0x0504,     HAL_FLOAT, 0.1,  "output-volt",       HAL_OUT, POLL_FAST,
+      REGISTER_PIN(output_volt) },
+    { 0x0505,     HAL_S32,   1,    "DC-bus-volt",       HAL_OUT, POLL_FAST,
+      REGISTER_PIN(dc_bus_volt) },
+    { 0x0506,     HAL_FLOAT, 0.1,  "load-percentage",   HAL_OUT, POLL_FAST,
+      REGISTER_PIN(motor_load) },
+    { 0x0507,     HAL_S32,   1,    "inverter-temp",     HAL_OUT, POLL_FAST,
+      REGISTER_PIN(inverter_temp) },
+};
+
+/** Number of registers to read */
+#define NUM_REGISTER_READ       ((int) (sizeof(registers) / sizeof(registers[0])))
+
+/* The poll groups are kept as bit masks */
+_Static_assert(NUM_REGISTER_READ <= 32, "too many registers for a poll group mask");
+
+/** Index in registers[] of VFD_STATUS, set by check_registers(). */
+static int status_index = -1;
+
+/** Index in registers[] of VFD_OUTPUT_FREQ, set by check_registers(). */
+static int output_freq_index = -1;
+
+/** Last value acknowledged by the vfd for a writable register. */
+struct shadow_register {
+    uint16_t value;
+    int valid;
+};
+
+/** Shadow copy of the writable registers, indexed from VFD_INSTRUCTION. */
+struct vfd_shadow {
+    struct shadow_register reg[NUM_REGISTER_WRITE];
+};
+
+/** Commands from LinuxCNC, sampled from the HAL pins. */
+struct vfd_command {
+    int spindle_on;
+    int spindle_fwd;
+    int spindle_rev;
+    double speed_cmd;               /*!< requested speed (RPM) */
+    double period;                  /*!< time between polls (s) */
+    double slow_period;             /*!< time between polls of slow group (s) */
+    double response_timeout;        /*!< wait for first byte of answer (s) */
+    double byte_timeout;            /*!< wait between bytes of answer (s) */
+    unsigned int reset_count;       /*!< statistics reset when it changes */
+};
+
+/** Latency of successful transactions of one kind (s). */
+struct latency_stats {
+    double last;
+    double min;
+    double max;
+    double avg;                     /*!< exponential moving average */
+    int count;
+    int histogram[NUM_LATENCY_BUCKETS];
+};
+
+/** Information acquired from vfd, and statistics from the I/O loop. */
+struct vfd_telemetry {
+    uint16_t data[NUM_REGISTER_READ];   /*!< in the order of registers[] */
+    double read_time;               /*!< CLOCK_MONOTONIC of last good read (s) */
+    int modbus_errors;
+    int suppressed_writes;          /*!< writes skipped by the shadow copy */
+    double cycle_time;              /*!< time between start of cycles (s) */
+    double max_cycle_time;          /*!< longest cycle time (s) */
+    double wakeup_jitter;           /*!< time the cycle started late (s) */
+    double max_wakeup_jitter;
+    int overruns;                   /*!< cycles that didn't finish in time */
+    int breaker_state;              /*!< enum breaker_state */
+    int comm_ok;
+    struct latency_stats latency[NUM_LATENCY_TYPES];
+};
+
+/** Flag set in triple_buffer::middle while it holds unread data. */
+#define TRIPLE_BUFFER_NEW 4
+
+/**
+ * Lock-free exchange of the latest value, between one producer thread and
+ * one consumer thread. Each side owns one of three buffers, the third one
+ * is swapped between them.
+ */
+struct triple_buffer {
+    atomic_uint middle;             /*!< shared buffer and TRIPLE_BUFFER_NEW */
+    unsigned int write;             /*!< buffer owned by producer */
+    unsigned int read;              /*!< buffer owned by consumer */
+};
+
+/** Commands and telemetry exchanged between the HAL loop and I/O thread. */
+struct vfd_exchange {
+    struct vfd_command cmd[3];
+    struct triple_buffer cmd_buffer;
+    struct vfd_telemetry telemetry[3];
+    struct triple_buffer telemetry_buffer;
+    struct vfd_command last_cmd;    /*!< only used by HAL loop */
+};
+
+/** Consecutive registers, read in one transaction. */
+struct register_block {
+    int addr;                       /*!< first register */
+    int nb;                         /*!< number of registers */
+    int index;                      /*!< of first register in registers[] */
+};
+
+/** How failed transactions are retried. */
+struct retry_policy {
+    int budget[NUM_OPS];            /*!< retries per operation and cycle */
+    double delay;                   /*!< delay before first retry (s) */
+    int breaker_threshold;          /*!< failures in a row to open breaker */
+    double probe_period;            /*!< time between probes, when open (s) */
+};
+
+/** Retry of a failed operation. */
+struct op_retry {
+    int pending;
+    int failures;                   /*!< failed attempts this cycle */
+    struct timespec retry_at;
+};
+
+/** Schedule of a periodic loop, with absolute deadlines. */
+struct loop_timer {
+    struct timespec deadline;
+    struct timespec cycle_start;
+    int waiting;                    /*!< deadline is set, but not reached */
+    double late;                    /*!< time deadline was reached late (s) */
+};
+
+/** Connection to one vfd, owned by the I/O loop. */
+struct vfd {
+    char name[HAL_NAME_LEN + 1];    /*!< prefix of pins, and in messages */
+    int target;                     /*!< Modbus address */
+    struct vfd_bus *bus;
+    struct haldata *haldata;        /*!< only used by I/O loop if unthreaded */
+    struct vfd_shadow shadow;       /*!< last values acknowledged by vfd */
+    enum combined_rw combined_rw;
+    int combined_rw_failures;       /*!< failed probes of function 0x17 */
+    double freq_calc;               /*!< frequency per RPM */
+    double max_freq;                /*!< maximum allowed frequency (Hz) */
+    struct vfd_command cmd;         /*!< latest commands from LinuxCNC */
+    struct vfd_telemetry telemetry;
+    struct vfd_exchange *exchange;  /*!< NULL if HAL is serviced in I/O loop */
+    struct loop_timer timer;        /*!< polling schedule */
+    struct register_block fast;     /*!< read every period */
+    struct register_block slow[NUM_REGISTER_READ];  /*!< read every slow period */
+    int num_slow;
+    struct timespec slow_deadline;  /*!< next read of the slow group */
+    struct retry_policy policy;
+    struct op_retry retry[NUM_OPS];
+    enum breaker_state breaker;
+    int failures;                   /*!< failed transactions in a row */
+    struct timespec probe_at;       /*!< next probe, when breaker is open */
+    double char_time;               /*!< time to send one character (s) */
+    double turnaround;              /*!< time for vfd to answer (s) */
+    double response_timeout;        /*!< timeouts set on the bus (s) */
+    double byte_timeout;
+    unsigned int reset_count;       /*!< last reset of the statistics */
+};
+
+/** Built-in Modbus RTU transport, used instead of libmodbus with --native-rtu. */
+struct rtu_port {
+    int fd;                         /*!< serial port, opened by libmodbus */
+    int slave;                      /*!< address of following requests */
+    double char_time;               /*!< time to send one character (s) */
+    double silence;                 /*!< silence between frames, T3.5 (s) */
+    double response_timeout;        /*!< time to wait for an answer (s) */
+    double byte_timeout;            /*!< time to wait between bytes (s) */
+    int stop_fd;                    /*!< ends any wait when readable, or -1 */
+    struct timespec idle_at;        /*!< end of silence after last frame */
+    int rts;                        /*!< MODBUS_RTU_RTS_* */
+    double rts_delay;               /*!< RTS held before and after sending (s) */
+    int debug;                      /*!< print frames */
+};
+
+/** Serial bus, with one or more vfds on it. */
+struct vfd_bus {
+    const char *device;             /*!< serial device node */
+    char stable_device[PATH_MAX];   /*!< link in SERIAL_BY_ID, with --by-id */
+    modbus_t *mb_ctx;
+    struct rtu_port *rtu;           /*!< NULL when libmodbus is used */
+    enum port_state port;
+    int port_error;                 /*!< errno that lost the port */
+    struct loop_timer reconnect_timer;
+    double char_time;               /*!< time to send one character (s) */
+    int verbose;                    /*!< print frames */
+    enum rs485_mode rs485_mode;     /*!< settings restored on reconnect */
+    double rts_delay;
+    int low_latency;
+    struct vfd *vfd;
+    int num_vfds;
+    int next;                       /*!< first in line, when due together */
+    int event_fd;                   /*!< signalled on new commands, or -1 */
+    pthread_t thread;               /*!< I/O thread, in threaded mode */
+    int broadcast;                  /*!< start and stop all vfds at once */
+    int priority;                   /*!< SCHED_FIFO priority of I/O loop, or 0 */
+    int cpu;                        /*!< CPU to run I/O loop on, or -1 */
+};
+
+/** Find register @p addr in registers[], return its index or -1. */
+static int find_register(int addr)
 {
-    int retries;
-    uint16_t receive_data[MODBUS_MAX_READ_REGISTERS];
+    int i;
 
-    for (retries = 0; retries <= NUM_MODBUS_RETRIES; retries++) {
-        int retval = modbus_read_registers(mb_ctx, START_REGISTER_READ,
-                                           NUM_REGISTER_READ, receive_data);
-
-        if (retval == NUM_REGISTER_READ) {
-            *hal_data_block->inverter_status = receive_data[0];
-            *hal_data_block->freq_cmd = receive_data[1] * 0.01;
-            *hal_data_block->output_freq = receive_data[2] * 0.01;
-            *hal_data_block->output_current = receive_data[3] * 0.1;
-            *hal_data_block->output_volt = receive_data[4] * 0.1;
-            *hal_data_block->dc_bus_volt = receive_data[5];
-            *hal_data_block->motor_load = receive_data[6] * 0.1;
-            *hal_data_block->inverter_temp = receive_data[7];
-            return 0;
-        }
-        fprintf(stderr, "%s: ERROR reading data for %d registers, from register 0x%04x: %s\n",
-                modname, NUM_REGISTER_READ, START_REGISTER_READ,
-                modbus_strerror(errno));
-        hal_data_block->modbus_errors++;
+    for (i = 0; i < NUM_REGISTER_READ; i++) {
+        if (registers[i].addr == addr)
+            return i;
     }
     return -1;
 }
 
+/** Get the pin of HAL_FLOAT register @p reg, in @p haldata. */
+static hal_float_t **register_float_pin(struct haldata *haldata,
+                                        const struct register_def *reg)
+{
+    return (hal_float_t **) ((char *) haldata + reg->field);
+}
+
+/** Get the pin of HAL_S32 register @p reg, in @p haldata. */
+static hal_s32_t **register_s32_pin(struct haldata *haldata,
+                                    const struct register_def *reg)
+{
+    return (hal_s32_t **) ((char *) haldata + reg->field);
+}
+
+/** Set the HAL pin of register @p reg, from @p count read from the vfd. */
+static void set_register_pin(struct haldata *haldata,
+                             const struct register_def *reg, uint16_t count)
+{
+    switch (reg->type) {
+    case HAL_FLOAT:
+        **register_float_pin(haldata, reg) = count * reg->scale;
+        break;
+    case HAL_S32:
+        **register_s32_pin(haldata, reg) = count;
+        break;
+    default:
+        break;
+    }
+}
+
+/** Check if the vfd reports running @p state, in @p inverter_status. */
+static int state_reached(int inverter_status, uint16_t state)
+{
+    return (inverter_status & (state == VFD_STOP ? 1 : 3)) == state;
+}
+
+/** Get shadow copy of register @p addr. */
+static struct shadow_register *shadow_reg(struct vfd_shadow *shadow, int addr)
+{
+    return &shadow->reg[addr - VFD_INSTRUCTION];
+}
+
+static atomic_int done;
+static int stop_fd = -1;            /*!< eventfd, readable once done is set */
+char *modname = "nowforever_vfd";
+
+/** Add @p seconds to @p ts. */
+static void timespec_add(struct timespec *ts, double seconds)
+{
+    time_t sec = (time_t) seconds;
+
+    ts->tv_sec += sec;
+    ts->tv_nsec += (long) ((seconds - sec) * 1000000000l);
+    if (ts->tv_nsec >= 1000000000l) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000l;
+    }
+}
+
+/** Return @p a - @p b in seconds. */
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) * 1e-9;
+}
+
+/** Start a periodic loop, the first deadline is one period from now. */
+static void loop_timer_start(struct loop_timer *timer)
+{
+    clock_gettime(CLOCK_MONOTONIC, &timer->deadline);
+    timer->cycle_start = timer->deadline;
+    timer->waiting = 0;
+}
+
+/** Set the next deadline, one period after the previous one. */
+static void loop_timer_arm(struct loop_timer *timer, double period)
+{
+    if (!timer->waiting) {
+        timespec_add(&timer->deadline, period);
+        timer->waiting = 1;
+    }
+}
+
+/**
+ * @brief Note that the deadline is reached, and how late.
+ * @param timer Schedule of the loop.
+ * @return @c WAKEUP_DEADLINE.
+ */
+static enum wakeup loop_timer_reached(struct loop_timer *timer)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timer->late = timespec_diff(&now, &timer->deadline);
+    timer->waiting = 0;
+    return WAKEUP_DEADLINE;
+}
+
 /**
- * @brief Set new state for vfd.
+ * @brief Sleep until the next deadline, until @p event_fd is signalled, or
+ *        until @p wake.
  *
- * Possible states is @c CW, @c CCW and @c STOP, it will only write to the
- * inverter if a new state has been requested.
+ * Sleeping until an absolute deadline means the period doesn't drift, and
+ * the time spent working doesn't add to it. When woken early, the deadline
+ * is kept, and the next call sleeps for the rest of the period. The sleep
+ * always ends at once when the driver is asked to exit.
  *
- * @param mb_ctx modbus context
- * @param haldata Information to and from LinuxCNC.
- * @return 0 on success and when we continue with the current state.
- *         Otherwise return -1.
+ * @param timer Schedule of the loop.
+ * @param period Time between deadlines (s).
+ * @param event_fd eventfd to wake up on, or -1.
+ * @param wake Time to wake up before the deadline, or NULL.
+ * @return Why the sleep ended.
  */
-static int set_vfd_state(modbus_t *mb_ctx, struct haldata *haldata)
+static enum wakeup loop_timer_sleep(struct loop_timer *timer, double period,
+                                    int event_fd, const struct timespec *wake)
 {
-    int retries;
-    uint16_t state;
+    struct pollfd pfd[2] = {
+        { .fd = event_fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN },
+    };
+    struct timespec now, timeout;
+    const struct timespec *until;
+    uint64_t events;
+    double remaining;
 
-    if (*haldata->spindle_on && *haldata->spindle_fwd &&
-       (*haldata->inverter_status & 3) != VFD_CW) {
-        state = VFD_CW;
-    } else if (*haldata->spindle_on && *haldata->spindle_rev &&
-              (*haldata->inverter_status & 3) != VFD_CCW) {
-        state = VFD_CCW;
-    } else if (!*haldata->spindle_on && (*haldata->inverter_status & 1) != VFD_STOP) {
-        state = VFD_STOP;
-    /* No new state has been requested. */
-    } else {
-        return 0;
-    }
+    loop_timer_arm(timer, period);
 
-    for (retries = 0; retries <= NUM_MODBUS_RETRIES; retries++) {
-        if (modbus_write_registers(mb_ctx, VFD_INSTRUCTION, 0x01, &state) == 1)
-            return 0;
-        fprintf(stderr, "%s: ERROR writing %u to register 0x%04x: %s\n",
-                modname, state, VFD_INSTRUCTION, modbus_strerror(errno));
-        haldata->modbus_errors++;
+    until = &timer->deadline;
+    if (wake && timespec_diff(wake, until) < 0)
+        until = wake;
+
+    for (;;) {
+        if (done)
+            return WAKEUP_STOP;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining = timespec_diff(until, &now);
+        if (remaining <= 0)
+            break;
+
+        /* ppoll() ignores the negative fds */
+        timeout.tv_sec = 0;
+        timeout.tv_nsec = 0;
+        timespec_add(&timeout, remaining);
+        if (ppoll(pfd, 2, &timeout, NULL) > 0 && (pfd[0].revents & POLLIN)) {
+            /* Reading resets the event counter */
+            if (read(event_fd, &events, sizeof(events)) == sizeof(events))
+                return WAKEUP_EVENT;
+        }
     }
-    return -1;
+    if (until == wake)
+        return WAKEUP_TIMEOUT;
+    return loop_timer_reached(timer);
 }
 
 /**
- * @brief Write new frequency to vfd.
+ * @brief Start a new cycle, after the deadline is reached.
+ * @param timer Schedule of the loop.
+ * @return Time since start of previous cycle (s).
+ */
+static double loop_timer_cycle(struct loop_timer *timer)
+{
+    struct timespec now;
+    double cycle_time;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    cycle_time = timespec_diff(&now, &timer->cycle_start);
+    timer->cycle_start = now;
+    return cycle_time;
+}
+
+/**
+ * @brief Check if the work in this cycle ran past the next deadline.
  *
- * If the new frequency is different from the current frequency, send
- * the new frequency to vfd. If the frequency is identical, do nothing.
- * Ensures that the frequency written to vfd is a positive number, and that the
- * frequency is never larger than @c max_freq.
+ * If it did, the schedule starts over from now, instead of trying to catch
+ * up with the missed cycles.
  *
- * @param mb_ctx modbus context
- * @param haldata Information to and from LinuxCNC.
- * @param freq_calc Calculated value, based on @c max_freq and
- *                  @c spindle_max_speed
- * @param max_freq Maximum allowed frequency.
- * @return 0 on success, or when it's not needed to write data to vfd.
- *         Otherwise return -1.
+ * @param timer Schedule of the loop.
+ * @param period Time between deadlines (s).
+ * @return 1 on overrun, otherwise 0.
  */
-static int set_vfd_freq(modbus_t *mb_ctx, struct haldata *haldata,
-                        double freq_calc, double max_freq)
+static int loop_timer_overrun(struct loop_timer *timer, double period)
 {
-    int retries;
-    uint16_t freq;
+    struct timespec now;
 
-    /* Ensure frequency is a positive number */
-    freq = abs((int) (*haldata->speed_cmd * freq_calc * 100));
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_diff(&now, &timer->deadline) > period) {
+        timer->deadline = now;
+        return 1;
+    }
+    return 0;
+}
 
-    /* Cap at max frequency */
-    if (freq > max_freq * 100)
-        freq = (uint16_t) (max_freq * 100);
+static void triple_buffer_init(struct triple_buffer *tb)
+{
+    tb->write = 0;
+    atomic_init(&tb->middle, 1);
+    tb->read = 2;
+}
 
-    /* Cast to int, to compare values. */
-    if (freq == (int) (*haldata->output_freq * 100))
-        return 0;
+/** Publish the producer's buffer, and take over a buffer to fill next. */
+static void triple_buffer_publish(struct triple_buffer *tb)
+{
+    tb->write = atomic_exchange(&tb->middle, tb->write | TRIPLE_BUFFER_NEW)
+                & ~TRIPLE_BUFFER_NEW;
+}
 
-    for (retries = 0; retries <= NUM_MODBUS_RETRIES; retries++) {
-        if (modbus_write_registers(mb_ctx, VFD_FREQUENCY, 0x01, &freq) == 1)
-            return 0;
-        fprintf(stderr, "%s: ERROR writing %u to register 0x%04x: %s\n",
-                modname, freq, VFD_FREQUENCY, modbus_strerror(errno));
-        haldata->modbus_errors++;
-    }
-    return -1;
+/**
+ * @brief Take over the latest published buffer.
+ * @return 1 if there was new data, 0 if the consumer keeps its buffer.
+ */
+static int triple_buffer_update(struct triple_buffer *tb)
+{
+    if (!(atomic_load(&tb->middle) & TRIPLE_BUFFER_NEW))
+        return 0;
+    tb->read = atomic_exchange(&tb->middle, tb->read) & ~TRIPLE_BUFFER_NEW;
+    return 1;
 }
 
-/* Write to vfd and set HAL pins */
-static void write_data(modbus_t *mb_ctx, struct haldata *haldata,
-                       double hzcalc, double max_freq)
+/**
+ * @brief Sample commands from HAL pins.
+ * @param haldata Information to and from LinuxCNC.
+ * @param cmd Commands to the I/O loop.
+ */
+static void sample_command(struct haldata *haldata, struct vfd_command *cmd)
 {
-    set_vfd_state(mb_ctx, haldata);
-    set_vfd_freq(mb_ctx, haldata, hzcalc, max_freq);
+    /* Don't scan to fast, and not delay more than a few seconds */
+    if (haldata->period < 0.001) haldata->period = 0.001;
+    if (haldata->period > 2.0) haldata->period = 2.0;
 
-    if (*haldata->output_freq == 0) {
-        *haldata->is_stopped = 1;
+    if (haldata->group) {
+        cmd->spindle_on = *haldata->group->spindle_on;
+        cmd->spindle_fwd = *haldata->group->spindle_fwd;
+        cmd->spindle_rev = *haldata->group->spindle_rev;
     } else {
-        *haldata->is_stopped = 0;
+        cmd->spindle_on = *haldata->spindle_on;
+        cmd->spindle_fwd = *haldata->spindle_fwd;
+        cmd->spindle_rev = *haldata->spindle_rev;
     }
+    cmd->speed_cmd = *haldata->speed_cmd;
+    cmd->period = haldata->period;
 
-    *haldata->speed_fb = *haldata->output_freq / hzcalc;
+    if (haldata->slow_period < haldata->period)
+        haldata->slow_period = haldata->period;
+    if (haldata->slow_period > 60.0) haldata->slow_period = 60.0;
+    cmd->slow_period = haldata->slow_period;
 
-    /* Calculates in % difference between set and actual frequency */
-    if (fabs(1 - (*haldata->freq_cmd / *haldata->output_freq)) < haldata->speed_tolerance) {
-        *haldata->at_speed = 1;
-    } else {
-        *haldata->at_speed = 0;
+    if (haldata->response_timeout < 0.001) haldata->response_timeout = 0.001;
+    if (haldata->response_timeout > 10.0) haldata->response_timeout = 10.0;
+    if (haldata->byte_timeout < 0.0001) haldata->byte_timeout = 0.0001;
+    if (haldata->byte_timeout > 1.0) haldata->byte_timeout = 1.0;
+    cmd->response_timeout = haldata->response_timeout;
+    cmd->byte_timeout = haldata->byte_timeout;
+
+    if (*haldata->reset_stats) {
+        haldata->reset_count++;
+        *haldata->reset_stats = 0;
     }
+    cmd->reset_count = haldata->reset_count;
+}
 
-    if (*haldata->spindle_on == 0)
-        *haldata->at_speed = 0;
+/**
+ * @brief Copy information from the I/O loop to HAL pins.
+ * @param haldata Information to and from LinuxCNC.
+ * @param telemetry Data read from vfd, and statistics.
+ */
+static void publish_telemetry(struct haldata *haldata,
+                              const struct vfd_telemetry *telemetry)
+{
+    const uint16_t *data = telemetry->data;
+    const struct latency_stats *stats;
+    struct latency_pins *pins;
+    int i, type, bucket;
 
-    if ((*haldata->inverter_status & 24) != 0)
-        *haldata->vfd_error = 1;
+    for (i = 0; i < NUM_REGISTER_READ; i++)
+        set_register_pin(haldata, &registers[i], data[i]);
+    *haldata->read_time = telemetry->read_time;
+
+    haldata->modbus_errors = telemetry->modbus_errors;
+    *haldata->suppressed_writes = telemetry->suppressed_writes;
+    *haldata->cycle_time = telemetry->cycle_time;
+    *haldata->max_cycle_time = telemetry->max_cycle_time;
+    *haldata->wakeup_jitter = telemetry->wakeup_jitter;
+    *haldata->max_wakeup_jitter = telemetry->max_wakeup_jitter;
+    *haldata->overruns = telemetry->overruns;
+    *haldata->breaker_state = telemetry->breaker_state;
+    *haldata->comm_ok = telemetry->comm_ok;
+
+    for (type = 0; type < NUM_LATENCY_TYPES; type++) {
+        pins = &haldata->latency[type];
+        stats = &telemetry->latency[type];
+        *pins->last = stats->last;
+        *pins->min = stats->min;
+        *pins->max = stats->max;
+        *pins->avg = stats->avg;
+        *pins->count = stats->count;
+        for (bucket = 0; bucket < NUM_LATENCY_BUCKETS; bucket++)
+            *pins->histogram[bucket] = stats->histogram[bucket];
+    }
 }
 
-/* Command-line options */
-static struct option long_options[] = {
-    {"device", 1, 0, 'd'},
-    {"name", 1, 0 , 'n'},
-    {"parity", 1, 0, 'p'},
-    {"rate", 1, 0, 'r'},
-    {"verbose", 0, 0, 'v'},
-    {"target", 1, 0, 't'},
-    {"help", 0, 0, 'h'},
-    {"spindle-max-speed", 1, 0, 'S'},
-    {"max-frequency", 1, 0, 'F'},
-    {0,0,0,0}
-};
+/**
+ * @brief Take over the latest commands from the HAL loop, in threaded mode.
+ * @param vfd Connection to vfd.
+ */
+static void fetch_command(struct vfd *vfd)
+{
+    struct vfd_exchange *exchange = vfd->exchange;
 
-static char *option_string = "d:n:p:r:vt:hS:F:";
+    if (exchange && triple_buffer_update(&exchange->cmd_buffer))
+        vfd->cmd = exchange->cmd[exchange->cmd_buffer.read];
+}
 
-static char *paritystrings[] = {"even", "odd", "none", NULL};
-static char paritychars[] = {'E', 'O', 'N'};
+/**
+ * @brief Check if LinuxCNC wants the spindle stopped, and the vfd hasn't
+ *        been told yet.
+ *
+ * Only in event driven mode, where a stop must not wait for other
+ * transactions.
+ *
+ * @param vfd Connection to vfd.
+ * @return 1 if a stop is pending, otherwise 0.
+ */
+static int stop_pending(struct vfd *vfd)
+{
+    struct shadow_register *instruction;
+
+    if (vfd->bus->event_fd < 0)
+        return 0;
+
+    fetch_command(vfd);
+    instruction = shadow_reg(&vfd->shadow, VFD_INSTRUCTION);
+    return !vfd->cmd.spindle_on &&
+           !(instruction->valid && instruction->value == VFD_STOP);
+}
+
+/**
+ * @brief Prepare the built-in RTU transport, on a port opened by libmodbus.
+ *
+ * libmodbus has already set the baud rate and character format, and the
+ * timeouts start out as in libmodbus. Writes to the port block, reads
+ * return at once with what has arrived, VMIN and VTIME are 0. The waiting
+ * is done by poll(), with the timeouts kept here, so it isn't rounded to
+ * the 0.1 s of VTIME, and it ends when the driver is asked to exit.
+ *
+ * @param rtu Transport to prepare.
+ * @param mb_ctx Connected libmodbus context.
+ * @param char_time Time to send one character (s).
+ * @param debug Print each frame.
+ * @return 0 on success, otherwise -1.
+ */
+static int rtu_init(struct rtu_port *rtu, modbus_t *mb_ctx, double char_time,
+                    int debug)
+{
+    int fd = modbus_get_socket(mb_ctx);
+    int flags = fcntl(fd, F_GETFL);
+    struct termios tios;
+    uint32_t sec, usec;
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) != 0)
+        return -1;
+    if (tcgetattr(fd, &tios) != 0)
+        return -1;
+    tios.c_cc[VMIN] = 0;
+    tios.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tios) != 0)
+        return -1;
+
+    modbus_get_response_timeout(mb_ctx, &sec, &usec);
+    rtu->response_timeout = sec + usec * 1e-6;
+    modbus_get_byte_timeout(mb_ctx, &sec, &usec);
+    rtu->byte_timeout = sec + usec * 1e-6;
+
+    rtu->fd = fd;
+    rtu->char_time = char_time;
+    rtu->silence = fmax(3.5 * char_time, MIN_FRAME_SILENCE);
+    rtu->stop_fd = stop_fd;
+    rtu->debug = debug;
+    clock_gettime(CLOCK_MONOTONIC, &rtu->idle_at);
+    return 0;
+}
+
+/**
+ * @brief Switch the RS485 transceiver, when RTS controls its direction.
+ * @param rtu Transport.
+ * @param sending 1 to send, 0 to receive.
+ */
+static void rtu_set_rts(struct rtu_port *rtu, int sending)
+{
+    int flag = TIOCM_RTS;
+
+    if (rtu->rts == MODBUS_RTU_RTS_NONE)
+        return;
+    ioctl(rtu->fd, ((rtu->rts == MODBUS_RTU_RTS_UP) == sending) ?
+          TIOCMBIS : TIOCMBIC, &flag);
+}
+
+/** Print a frame, in the format libmodbus uses in debug mode. */
+static void rtu_print_frame(const char *direction, const uint8_t *frame,
+                            int len)
+{
+    int i;
+
+    printf("%s", direction);
+    for (i = 0; i < len; i++)
+        printf("[%.2X]", frame[i]);
+    printf("\n");
+}
+
+/**
+ * @brief Wait until @p until, or until the port has data to read.
+ *
+ * The wait ends at once when @c stop_fd of @p rtu is readable, the driver
+ * is then asked to exit.
+ *
+ * @param rtu Transport.
+ * @param until Time to wait until.
+ * @param input 1 to end the wait when there is data to read, 0 to sleep.
+ * @return 1 when there is data to read, 0 when @p until is reached,
+ *         otherwise -1 with errno set, to EINTR when asked to exit.
+ */
+static int rtu_wait(struct rtu_port *rtu, const struct timespec *until,
+                    int input)
+{
+    /* ppoll() ignores the negative fds */
+    struct pollfd pfd[2] = {
+        { .fd = input ? rtu->fd : -1, .events = POLLIN },
+        { .fd = rtu->stop_fd, .events = POLLIN },
+    };
+    struct timespec now, timeout;
+    double remaining;
+
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining = timespec_diff(until, &now);
+        timeout.tv_sec = 0;
+        timeout.tv_nsec = 0;
+        timespec_add(&timeout, fmax(remaining, 0.0));
+        if (ppoll(pfd, 2, &timeout, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (pfd[1].revents) {
+            errno = EINTR;
+            return -1;
+        }
+        if (pfd[0].revents)
+            return 1;
+        if (remaining <= 0)
+            return 0;
+    }
+}
+
+/**
+ * @brief Check the answer to a request.
+ *
+ * @param req Request, with CRC.
+ * @param rsp Answer, with CRC.
+ * @param len Length of answer.
+ * @param rsp_len Expected length of answer.
+ * @return 0 if it is the expected answer, otherwise -1, with errno set to
+ *         the libmodbus error code.
+ */
+static int rtu_check_answer(const uint8_t *req, const uint8_t *rsp, int len,
+                            int rsp_len)
+{
+    if (len == EXCEPTION_RESPONSE_SIZE && rsp[1] == (req[1] | 0x80) &&
+        crc16(rsp, len - 2) == (rsp[len - 2] | (rsp[len - 1] << 8))) {
+        errno = MODBUS_ENOBASE + rsp[2];
+        return -1;
+    }
+    if (len != rsp_len) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+    if (crc16(rsp, len - 2) != (rsp[len - 2] | (rsp[len - 1] << 8))) {
+        errno = EMBBADCRC;
+        return -1;
+    }
+    if (rsp[0] != req[0] || rsp[1] != req[1]) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send a request, and receive the answer.
+ *
+ * The request is sent when the line has been silent for 3.5 characters
+ * after the last frame. The answer is read as it arrives, until it has the
+ * expected length, or until the line has been silent for the byte timeout.
+ * An exception answer is shorter, it is recognised by its function code,
+ * so it doesn't wait for the byte timeout either. Every wait ends when the
+ * driver is asked to exit.
+ *
+ * @param rtu Transport.
+ * @param req Request without CRC, with room for the CRC.
+ * @param req_len Length of request, without CRC.
+ * @param rsp Room for the answer.
+ * @param rsp_len Length of the answer, with CRC.
+ * @return 0 on success, otherwise -1 with errno set like libmodbus does.
+ */
+static int rtu_transaction(struct rtu_port *rtu, uint8_t *req, int req_len,
+                           uint8_t *rsp, int rsp_len)
+{
+    struct timespec sent, until;
+    uint16_t crc = crc16(req, req_len);
+    ssize_t len, got;
+    int retval;
+
+    req[req_len++] = crc & 0xFF;
+    req[req_len++] = crc >> 8;
+
+    if (rtu_wait(rtu, &rtu->idle_at, 0) != 0)
+        return -1;
+    tcflush(rtu->fd, TCIFLUSH);
+    if (rtu->debug)
+        rtu_print_frame("", req, req_len);
+
+    if (rtu->rts != MODBUS_RTU_RTS_NONE) {
+        rtu_set_rts(rtu, 1);
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        timespec_add(&until, rtu->rts_delay);
+        if (rtu_wait(rtu, &until, 0) != 0) {
+            rtu_set_rts(rtu, 0);
+            return -1;
+        }
+    }
+
+    /* Like libmodbus, the response timeout starts when the request is queued */
+    clock_gettime(CLOCK_MONOTONIC, &sent);
+    len = write(rtu->fd, req, req_len);
+    if (rtu->rts != MODBUS_RTU_RTS_NONE) {
+        tcdrain(rtu->fd);
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        timespec_add(&until, rtu->rts_delay);
+        rtu_wait(rtu, &until, 0);
+        rtu_set_rts(rtu, 0);
+    }
+    rtu->idle_at = sent;
+    timespec_add(&rtu->idle_at, req_len * rtu->char_time + rtu->silence);
+    if (len != req_len) {
+        if (len >= 0)
+            errno = EIO;
+        return -1;
+    }
+
+    /* Nobody answers a broadcast, give the vfds the timeout to act on it */
+    if (req[0] == MODBUS_BROADCAST_ADDRESS) {
+        timespec_add(&sent, rtu->response_timeout);
+        if (timespec_diff(&sent, &rtu->idle_at) > 0)
+            rtu->idle_at = sent;
+        return 0;
+    }
+
+    /* The first byte within the response timeout, the rest each within the
+       byte timeout */
+    until = sent;
+    timespec_add(&until, rtu->response_timeout);
+    for (len = 0; len < rsp_len;) {
+        retval = rtu_wait(rtu, &until, 1);
+        if (retval < 0) {
+            /* The answer may still come, keep the next frame clear of it */
+            rtu->idle_at = sent;
+            timespec_add(&rtu->idle_at, rtu->response_timeout +
+                         rsp_len * rtu->char_time + rtu->silence);
+            return -1;
+        }
+        if (retval == 0)
+            break;
+
+        got = read(rtu->fd, rsp + len, rsp_len - len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got == 0)
+            errno = ECONNRESET;     /* hung up, the device is gone */
+        if (got <= 0)
+            return -1;
+        len += got;
+
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        timespec_add(&until, rtu->byte_timeout);
+        if (len == EXCEPTION_RESPONSE_SIZE && rsp[1] == (req[1] | 0x80))
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &rtu->idle_at);
+    timespec_add(&rtu->idle_at, rtu->silence);
+    if (len == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    if (rtu->debug) {
+        printf("Waiting for a confirmation...\n");
+        rtu_print_frame("<", rsp, len);
+    }
+    return rtu_check_answer(req, rsp, len, rsp_len);
+}
+
+/**
+ * @brief Read registers with the built-in transport, Modbus function 0x03.
+ * @return Number of registers read, or -1 on error.
+ */
+static int rtu_read_registers(struct rtu_port *rtu, int addr, int nb,
+                              uint16_t *dest)
+{
+    uint8_t req[READ_REQUEST_SIZE];
+    uint8_t rsp[READ_RESPONSE_SIZE(MODBUS_MAX_READ_REGISTERS)];
+    int i;
+
+    req[0] = rtu->slave;
+    req[1] = MODBUS_FC_READ_HOLDING_REGISTERS;
+    MODBUS_SET_INT16_TO_INT8(req, 2, addr);
+    MODBUS_SET_INT16_TO_INT8(req, 4, nb);
+    if (rtu_transaction(rtu, req, 6, rsp, READ_RESPONSE_SIZE(nb)) != 0)
+        return -1;
+    if (rsp[2] != 2 * nb) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    for (i = 0; i < nb; i++)
+        dest[i] = MODBUS_GET_INT16_FROM_INT8(rsp, 3 + 2 * i);
+    return nb;
+}
+
+/**
+ * @brief Write registers with the built-in transport, Modbus function 0x10.
+ * @return Number of registers written, or -1 on error.
+ */
+static int rtu_write_registers(struct rtu_port *rtu, int addr, int nb,
+                               const uint16_t *src)
+{
+    uint8_t req[WRITE_REQUEST_SIZE(MODBUS_MAX_WRITE_REGISTERS)];
+    uint8_t rsp[WRITE_RESPONSE_SIZE];
+    int i;
+
+    req[0] = rtu->slave;
+    req[1] = MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+    MODBUS_SET_INT16_TO_INT8(req, 2, addr);
+    MODBUS_SET_INT16_TO_INT8(req, 4, nb);
+    req[6] = 2 * nb;
+    for (i = 0; i < nb; i++)
+        MODBUS_SET_INT16_TO_INT8(req, 7 + 2 * i, src[i]);
+    if (rtu_transaction(rtu, req, 7 + 2 * nb, rsp, WRITE_RESPONSE_SIZE) != 0)
+        return -1;
+    if (rtu->slave == MODBUS_BROADCAST_ADDRESS)
+        return nb;
+    if (memcmp(&rsp[2], &req[2], 4) != 0) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+    return nb;
+}
+
+/**
+ * @brief Write and read registers with the built-in transport, Modbus
+ *        function 0x17.
+ * @return Number of registers read, or -1 on error.
+ */
+static int rtu_write_and_read_registers(struct rtu_port *rtu, int write_addr,
+                                        int write_nb, const uint16_t *src,
+                                        int read_addr, int read_nb,
+                                        uint16_t *dest)
+{
+    uint8_t req[WRITE_REQUEST_SIZE(MODBUS_MAX_WR_WRITE_REGISTERS) + 4];
+    uint8_t rsp[READ_RESPONSE_SIZE(MODBUS_MAX_WR_READ_REGISTERS)];
+    int i;
+
+    req[0] = rtu->slave;
+    req[1] = MODBUS_FC_WRITE_AND_READ_REGISTERS;
+    MODBUS_SET_INT16_TO_INT8(req, 2, read_addr);
+    MODBUS_SET_INT16_TO_INT8(req, 4, read_nb);
+    MODBUS_SET_INT16_TO_INT8(req, 6, write_addr);
+    MODBUS_SET_INT16_TO_INT8(req, 8, write_nb);
+    req[10] = 2 * write_nb;
+    for (i = 0; i < write_nb; i++)
+        MODBUS_SET_INT16_TO_INT8(req, 11 + 2 * i, src[i]);
+    if (rtu_transaction(rtu, req, 11 + 2 * write_nb, rsp,
+                        READ_RESPONSE_SIZE(read_nb)) != 0)
+        return -1;
+    if (rsp[2] != 2 * read_nb) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    for (i = 0; i < read_nb; i++)
+        dest[i] = MODBUS_GET_INT16_FROM_INT8(rsp, 3 + 2 * i);
+    return read_nb;
+}
+
+/** Address the following requests on @p bus to @p slave. */
+static int bus_set_slave(struct vfd_bus *bus, int slave)
+{
+    if (bus->rtu) {
+        bus->rtu->slave = slave;
+        return 0;
+    }
+    return modbus_set_slave(bus->mb_ctx, slave);
+}
+
+/**
+ * @brief Set the timeouts of the following requests on @p bus.
+ * @param bus Serial bus.
+ * @param response_timeout Time to wait for the first byte of an answer (s).
+ * @param byte_timeout Time to wait between bytes of an answer (s).
+ * @return 0 on success, otherwise -1.
+ */
+static int bus_set_timeouts(struct vfd_bus *bus, double response_timeout,
+                            double byte_timeout)
+{
+    uint32_t response_sec = (uint32_t) response_timeout;
+    uint32_t byte_sec = (uint32_t) byte_timeout;
+
+    if (bus->rtu) {
+        bus->rtu->response_timeout = response_timeout;
+        bus->rtu->byte_timeout = byte_timeout;
+        return 0;
+    }
+
+    if (modbus_set_response_timeout(bus->mb_ctx, response_sec,
+            (uint32_t) ((response_timeout - response_sec) * 1000000)) != 0 ||
+        modbus_set_byte_timeout(bus->mb_ctx, byte_sec,
+            (uint32_t) ((byte_timeout - byte_sec) * 1000000)) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Note if a transaction on @p bus failed because the serial device
+ *        is gone, like an unplugged USB adapter.
+ *
+ * The I/O loop then closes the port, and reopens it when it is back.
+ *
+ * @param bus Serial bus.
+ * @param retval Return value of the transaction.
+ * @return @p retval, with errno kept.
+ */
+static int bus_check(struct vfd_bus *bus, int retval)
+{
+    if (retval < 0 && bus->port == PORT_OPEN &&
+        (errno == EIO || errno == ENXIO || errno == ENODEV ||
+         errno == EBADF || errno == ECONNRESET)) {
+        bus->port = PORT_LOST;
+        bus->port_error = errno;
+    }
+    return retval;
+}
+
+/** Like modbus_read_registers(), with the transport of @p bus. */
+static int bus_read_registers(struct vfd_bus *bus, int addr, int nb,
+                              uint16_t *dest)
+{
+    if (bus->rtu)
+        return bus_check(bus, rtu_read_registers(bus->rtu, addr, nb, dest));
+    return bus_check(bus, modbus_read_registers(bus->mb_ctx, addr, nb, dest));
+}
+
+/** Like modbus_write_registers(), with the transport of @p bus. */
+static int bus_write_registers(struct vfd_bus *bus, int addr, int nb,
+                               const uint16_t *src)
+{
+    if (bus->rtu)
+        return bus_check(bus, rtu_write_registers(bus->rtu, addr, nb, src));
+    return bus_check(bus, modbus_write_registers(bus->mb_ctx, addr, nb, src));
+}
+
+/** Like modbus_write_and_read_registers(), with the transport of @p bus. */
+static int bus_write_and_read_registers(struct vfd_bus *bus, int write_addr,
+                                        int write_nb, const uint16_t *src,
+                                        int read_addr, int read_nb,
+                                        uint16_t *dest)
+{
+    if (bus->rtu)
+        return bus_check(bus, rtu_write_and_read_registers(bus->rtu,
+                                write_addr, write_nb, src, read_addr, read_nb,
+                                dest));
+    return bus_check(bus, modbus_write_and_read_registers(bus->mb_ctx,
+                            write_addr, write_nb, src, read_addr, read_nb,
+                            dest));
+}
+
+/**
+ * @brief Print an error from a failed transaction.
+ *
+ * Nothing is printed while the circuit breaker is open, we already know the
+ * vfd doesn't answer, nor for a wait that was cut short to exit.
+ *
+ * @param vfd Connection to vfd.
+ * @param fmt printf() style format, the Modbus error is appended.
+ */
+static void print_error(struct vfd *vfd, const char *fmt, ...)
+{
+    va_list ap;
+    int error = errno;
+
+    if (vfd->breaker == BREAKER_OPEN || (error == EINTR && done))
+        return;
+
+    fprintf(stderr, "%s: ERROR ", vfd->name);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, ": %s\n", modbus_strerror(error));
+}
+
+/**
+ * @brief Store registers read from vfd.
+ *
+ * The time of the read is only kept when @p block has the output
+ * frequency, as the age of the telemetry and the ramp model go by it.
+ *
+ * @param vfd Connection to vfd.
+ * @param block Registers that was read.
+ * @param data @c block->nb registers.
+ */
+static void store_data(struct vfd *vfd, const struct register_block *block,
+                       const uint16_t *data)
+{
+    struct timespec now;
+
+    memcpy(&vfd->telemetry.data[block->index], data,
+           block->nb * sizeof(*data));
+    if (output_freq_index < block->index ||
+        output_freq_index >= block->index + block->nb)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    vfd->telemetry.read_time = now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Find the kind of transaction that writes to @p addr.
+ *
+ * A write that includes the state counts as a state write, also when the
+ * frequency is written in the same transaction.
+ */
+static enum latency_type write_latency_type(int addr)
+{
+    return addr == VFD_INSTRUCTION ? LATENCY_STATE_WRITE : LATENCY_FREQ_WRITE;
+}
+
+/**
+ * @brief Add a latency to the statistics.
+ * @param stats Statistics of one kind of transaction.
+ * @param latency Time the transaction took (s).
+ */
+static void add_latency(struct latency_stats *stats, double latency)
+{
+    int bucket = 0;
+
+    stats->last = latency;
+    if (stats->count == 0 || latency < stats->min)
+        stats->min = latency;
+    if (latency > stats->max)
+        stats->max = latency;
+    if (stats->count == 0)
+        stats->avg = latency;
+    else
+        stats->avg += LATENCY_EWMA_WEIGHT * (latency - stats->avg);
+    stats->count++;
+
+    while (bucket < NUM_LATENCY_BUCKETS - 1 &&
+           latency >= latency_bucket_limits[bucket])
+        bucket++;
+    stats->histogram[bucket]++;
+}
+
+/**
+ * @brief Add the latency of a successful transaction to the statistics.
+ * @param vfd Connection to vfd.
+ * @param type Kind of transaction.
+ * @param start Time the transaction started.
+ * @return Time the transaction took (s).
+ */
+static double record_latency(struct vfd *vfd, enum latency_type type,
+                             const struct timespec *start)
+{
+    struct timespec now;
+    double latency;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    latency = timespec_diff(&now, start);
+    add_latency(&vfd->telemetry.latency[type], latency);
+    return latency;
+}
+
+/**
+ * @brief Reset the statistics, when LinuxCNC asks for it.
+ * @param vfd Connection to vfd.
+ */
+static void check_stats_reset(struct vfd *vfd)
+{
+    if (vfd->cmd.reset_count == vfd->reset_count)
+        return;
+
+    vfd->reset_count = vfd->cmd.reset_count;
+    memset(vfd->telemetry.latency, 0, sizeof(vfd->telemetry.latency));
+    vfd->telemetry.max_cycle_time = 0;
+    vfd->telemetry.max_wakeup_jitter = 0;
+    vfd->telemetry.overruns = 0;
+}
+
+/**
+ * @brief Read a block of registers from vfd.
+ * @param vfd Connection to vfd.
+ * @param block Registers to read.
+ * @return 0 on success, otherwise -1.
+ */
+static int read_block(struct vfd *vfd, const struct register_block *block)
+{
+    uint16_t receive_data[MODBUS_MAX_READ_REGISTERS];
+    struct timespec start;
+    double latency, wire_time;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (bus_read_registers(vfd->bus, block->addr, block->nb,
+                           receive_data) != block->nb) {
+        print_error(vfd, "reading data for %d registers, from register 0x%04x",
+                    block->nb, block->addr);
+        return -1;
+    }
+    latency = record_latency(vfd, LATENCY_READ, &start);
+
+    /* What's left is the vfd, the adapter and the RS485 direction switch */
+    wire_time = (READ_REQUEST_SIZE + READ_RESPONSE_SIZE(block->nb)) *
+                vfd->char_time;
+    add_latency(&vfd->telemetry.latency[LATENCY_TURNAROUND],
+                fmax(latency - wire_time, 0.0));
+    store_data(vfd, block, receive_data);
+    return 0;
+}
+
+/**
+ * @brief Read the slow group from vfd.
+ * @param vfd Connection to vfd.
+ * @return 0 on success, -1 if any of the blocks failed.
+ */
+static int read_slow_data(struct vfd *vfd)
+{
+    int i, retval = 0;
+
+    for (i = 0; i < vfd->num_slow; i++)
+        retval |= read_block(vfd, &vfd->slow[i]);
+    return retval;
+}
+
+/**
+ * @brief Write one or more consecutive registers to vfd.
+ *
+ * @param vfd Connection to vfd.
+ * @param addr Address of first register.
+ * @param nb Number of registers to write.
+ * @param values Values to write, @p nb entries.
+ * @return 0 on success, otherwise -1.
+ */
+static int write_registers(struct vfd *vfd, int addr, int nb,
+                           const uint16_t *values)
+{
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (bus_write_registers(vfd->bus, addr, nb, values) == nb) {
+        record_latency(vfd, write_latency_type(addr), &start);
+        return 0;
+    }
+
+    if (nb == 1)
+        print_error(vfd, "writing %u to register 0x%04x", values[0], addr);
+    else
+        print_error(vfd, "writing %d registers, from register 0x%04x", nb, addr);
+    return -1;
+}
+
+/**
+ * @brief Find the state LinuxCNC has requested.
+ *
+ * @param cmd Commands from LinuxCNC.
+ * @param state @c CW, @c CCW or @c STOP, only valid when 1 is returned.
+ * @return 1 if a state has been requested, 0 if the requested direction
+ *         is unknown.
+ */
+static int get_target_state(const struct vfd_command *cmd, uint16_t *state)
+{
+    if (cmd->spindle_on && cmd->spindle_fwd) {
+        *state = VFD_CW;
+    } else if (cmd->spindle_on && cmd->spindle_rev) {
+        *state = VFD_CCW;
+    } else if (!cmd->spindle_on) {
+        *state = VFD_STOP;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Find the frequency LinuxCNC has requested.
+ *
+ * Ensures that the frequency written to vfd is a positive number, and that the
+ * frequency is never larger than @c max_freq.
+ *
+ * @param vfd Connection to vfd.
+ * @return Frequency in 0.01 Hz.
+ */
+static uint16_t get_target_freq(struct vfd *vfd)
+{
+    uint16_t freq;
+
+    /* Ensure frequency is a positive number */
+    freq = abs((int) (vfd->cmd.speed_cmd * vfd->freq_calc * 100));
+
+    /* Cap at max frequency */
+    if (freq > vfd->max_freq * 100)
+        freq = (uint16_t) (vfd->max_freq * 100);
+
+    return freq;
+}
+
+/**
+ * @brief Find the state the vfd should be set to.
+ *
+ * Possible states is @c CW, @c CCW and @c STOP, a state is only returned if
+ * it differs from the last state acknowledged by the inverter.
+ *
+ * @param vfd Connection to vfd.
+ * @param state New state, only valid when 1 is returned.
+ * @return 1 if a new state has been requested, 0 when we continue with the
+ *         current state.
+ */
+static int get_vfd_state(struct vfd *vfd, uint16_t *state)
+{
+    struct vfd_shadow *shadow = &vfd->shadow;
+
+    /* No new state has been requested. */
+    if (!get_target_state(&vfd->cmd, state))
+        return 0;
+
+    /*
+     * The inverter reports stopped while we have told it to run, it has
+     * been stopped by other means, or it has lost power. Forget everything
+     * we have written.
+     */
+    if (shadow_reg(shadow, VFD_INSTRUCTION)->valid &&
+        (shadow_reg(shadow, VFD_INSTRUCTION)->value & 1) &&
+        (vfd->telemetry.data[status_index] & 1) == VFD_STOP) {
+        shadow_reg(shadow, VFD_INSTRUCTION)->valid = 0;
+        shadow_reg(shadow, VFD_FREQUENCY)->valid = 0;
+    }
+
+    return !shadow_reg(shadow, VFD_INSTRUCTION)->valid ||
+           shadow_reg(shadow, VFD_INSTRUCTION)->value != *state;
+}
+
+/**
+ * @brief Find the frequency the vfd should be set to.
+ *
+ * A frequency is only returned if it differs from the last frequency
+ * acknowledged by the inverter.
+ *
+ * @param vfd Connection to vfd.
+ * @param freq New frequency in 0.01 Hz, only valid when 1 is returned.
+ * @return 1 if the frequency must be written to vfd, otherwise 0.
+ */
+static int get_vfd_freq(struct vfd *vfd, uint16_t *freq)
+{
+    struct vfd_shadow *shadow = &vfd->shadow;
+
+    *freq = get_target_freq(vfd);
+    return !shadow_reg(shadow, VFD_FREQUENCY)->valid ||
+           shadow_reg(shadow, VFD_FREQUENCY)->value != *freq;
+}
+
+/**
+ * @brief Count writes that are skipped because of the shadow copy.
+ *
+ * These would have been written, if we compared against the state and
+ * frequency reported by the inverter, while it ramps up or down.
+ *
+ * @param vfd Connection to vfd.
+ */
+static void count_suppressed_writes(struct vfd *vfd)
+{
+    struct shadow_register *reg;
+    uint16_t inverter_status = vfd->telemetry.data[status_index];
+    uint16_t value;
+
+    reg = shadow_reg(&vfd->shadow, VFD_INSTRUCTION);
+    if (get_target_state(&vfd->cmd, &value) && reg->valid && reg->value == value &&
+        !state_reached(inverter_status, value))
+        vfd->telemetry.suppressed_writes++;
+
+    reg = shadow_reg(&vfd->shadow, VFD_FREQUENCY);
+    value = get_target_freq(vfd);
+    if (reg->valid && reg->value == value && value != vfd->telemetry.data[output_freq_index])
+        vfd->telemetry.suppressed_writes++;
+}
+
+/**
+ * @brief Find which registers must be written to vfd.
+ *
+ * @c VFD_INSTRUCTION and @c VFD_FREQUENCY are adjacent, when both have
+ * changed they are returned as one block.
+ *
+ * @param vfd Connection to vfd.
+ * @param addr Address of first register to write.
+ * @param values Values to write, room for @c NUM_REGISTER_WRITE entries.
+ * @return Number of registers to write, 0 if nothing has changed.
+ */
+static int get_vfd_command(struct vfd *vfd, int *addr, uint16_t *values)
+{
+    uint16_t command[NUM_REGISTER_WRITE] = { 0 };
+    int new_state, new_freq;
+
+    new_state = get_vfd_state(vfd, &command[0]);
+    new_freq = get_vfd_freq(vfd, &command[1]);
+
+    if (new_state && new_freq) {
+        *addr = VFD_INSTRUCTION;
+        values[0] = command[0];
+        values[1] = command[1];
+        return 2;
+    }
+    if (new_state) {
+        *addr = VFD_INSTRUCTION;
+        values[0] = command[0];
+        return 1;
+    }
+    if (new_freq) {
+        *addr = VFD_FREQUENCY;
+        values[0] = command[1];
+        return 1;
+    }
+    return 0;
+}
+
+/** Check if there are commands the vfd hasn't acknowledged. */
+static int command_pending(struct vfd *vfd)
+{
+    uint16_t command[NUM_REGISTER_WRITE];
+    int addr;
+
+    return get_vfd_command(vfd, &addr, command) != 0;
+}
+
+/**
+ * @brief Update the shadow copy after writing registers.
+ *
+ * The shadow copy is invalidated on failure, we don't know if the inverter
+ * received the new values or not.
+ */
+static void update_shadow(struct vfd_shadow *shadow, int addr, int nb,
+                          const uint16_t *values, int success)
+{
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        shadow_reg(shadow, addr + i)->value = values[i];
+        shadow_reg(shadow, addr + i)->valid = success;
+    }
+}
+
+/**
+ * @brief Write registers and read the fast group from vfd, in one
+ *        transaction.
+ *
+ * Uses Modbus function 0x17, write and read registers. The registers are
+ * written before they are read.
+ *
+ * @param vfd Connection to vfd.
+ * @param addr Address of first register to write.
+ * @param nb Number of registers to write.
+ * @param values Values to write, @p nb entries.
+ * @return 0 on success, otherwise -1.
+ */
+static int write_and_read_data(struct vfd *vfd, int addr, int nb,
+                               const uint16_t *values)
+{
+    uint16_t receive_data[MODBUS_MAX_WR_READ_REGISTERS];
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (bus_write_and_read_registers(vfd->bus, addr, nb, values,
+                                     vfd->fast.addr, vfd->fast.nb,
+                                     receive_data) != vfd->fast.nb) {
+        print_error(vfd, "writing %d registers to 0x%04x and reading %d registers from 0x%04x",
+                    nb, addr, vfd->fast.nb, vfd->fast.addr);
+        return -1;
+    }
+    record_latency(vfd, write_latency_type(addr), &start);
+    store_data(vfd, &vfd->fast, receive_data);
+    return 0;
+}
+
+/**
+ * @brief Find out if the vfd supports Modbus function 0x17.
+ *
+ * The command is sent with function 0x17. If the vfd answers that with
+ * an illegal function exception, it doesn't support function 0x17.
+ * Otherwise the command is sent the usual way, and the probe is repeated
+ * with the next command, since a timeout or a bad CRC may just be noise on
+ * the line. Only when the usual way works and function 0x17 has failed
+ * COMBINED_RW_PROBES times in a row, is it given up on.
+ *
+ * @param vfd Connection to vfd, @c combined_rw is updated with the result.
+ * @param addr Address of first register to write.
+ * @param nb Number of registers to write.
+ * @param values Values to write, @p nb entries.
+ * @return 0 if the command was written, otherwise -1.
+ */
+static int probe_combined_rw(struct vfd *vfd, int addr, int nb,
+                             const uint16_t *values)
+{
+    int retval, error;
+    uint16_t receive_data[MODBUS_MAX_WR_READ_REGISTERS];
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    retval = bus_write_and_read_registers(vfd->bus, addr, nb, values,
+                                          vfd->fast.addr, vfd->fast.nb,
+                                          receive_data);
+    if (retval == vfd->fast.nb) {
+        record_latency(vfd, write_latency_type(addr), &start);
+        store_data(vfd, &vfd->fast, receive_data);
+        printf("%s: vfd supports function 0x17, using combined read and write\n",
+               vfd->name);
+        vfd->combined_rw = COMBINED_RW_ON;
+        return 0;
+    }
+    error = errno;
+
+    retval = write_registers(vfd, addr, nb, values);
+    if (error != EMBXILFUN && retval == 0)
+        vfd->combined_rw_failures++;
+    if (error == EMBXILFUN || vfd->combined_rw_failures >= COMBINED_RW_PROBES) {
+        printf("%s: vfd does not support function 0x17 (%s), using separate read and write\n",
+               vfd->name, modbus_strerror(error));
+        vfd->combined_rw = COMBINED_RW_OFF;
+    }
+    return retval;
+}
+
+/**
+ * @brief Send new state and frequency to vfd.
+ *
+ * In combined mode, the fast group is read in the same transaction.
+ *
+ * @param vfd Connection to vfd.
+ * @return 0 on success, otherwise -1.
+ */
+static int set_vfd_command(struct vfd *vfd)
+{
+    uint16_t command[NUM_REGISTER_WRITE];
+    int addr, nb, retval;
+
+    nb = get_vfd_command(vfd, &addr, command);
+    if (nb == 0)
+        return 0;
+
+    switch (vfd->combined_rw) {
+    case COMBINED_RW_ON:
+        retval = write_and_read_data(vfd, addr, nb, command);
+        break;
+    case COMBINED_RW_PROBE:
+        retval = probe_combined_rw(vfd, addr, nb, command);
+        break;
+    default:
+        retval = write_registers(vfd, addr, nb, command);
+        break;
+    }
+    update_shadow(&vfd->shadow, addr, nb, command, retval == 0);
+    return retval;
+}
+
+/**
+ * @brief Stop all traffic to the vfd, except for a probe now and then.
+ * @param vfd Connection to vfd.
+ */
+static void open_breaker(struct vfd *vfd)
+{
+    int op;
+
+    if (vfd->breaker == BREAKER_CLOSED)
+        fprintf(stderr, "%s: ERROR: vfd is not responding, probing every %g s\n",
+                vfd->name, vfd->policy.probe_period);
+    vfd->breaker = BREAKER_OPEN;
+
+    for (op = 0; op < NUM_OPS; op++) {
+        vfd->retry[op].pending = 0;
+        vfd->retry[op].failures = 0;
+    }
+
+    /* The vfd may have lost power, we don't know what it remembers. */
+    memset(&vfd->shadow, 0, sizeof(vfd->shadow));
+
+    clock_gettime(CLOCK_MONOTONIC, &vfd->probe_at);
+    timespec_add(&vfd->probe_at, vfd->policy.probe_period);
+}
+
+/**
+ * @brief Try an operation once, and schedule a retry if it fails.
+ *
+ * Retries are delayed, the delay is doubled for each failed attempt, until
+ * the retry budget of the operation is spent. If too many attempts in a row
+ * fail, the circuit breaker opens.
+ *
+ * @param vfd Connection to vfd.
+ * @param op Operation to run.
+ */
+static void do_op(struct vfd *vfd, enum vfd_op op)
+{
+    struct op_retry *retry = &vfd->retry[op];
+    int retval;
+
+    if (vfd->breaker == BREAKER_OPEN)
+        return;
+
+    switch (op) {
+    case OP_READ:
+        retval = read_block(vfd, &vfd->fast);
+        break;
+    case OP_READ_SLOW:
+        retval = read_slow_data(vfd);
+        break;
+    default:
+        if (!command_pending(vfd)) {
+            retry->pending = 0;
+            return;
+        }
+        retval = set_vfd_command(vfd);
+        break;
+    }
+
+    if (retval == 0) {
+        retry->pending = 0;
+        retry->failures = 0;
+        vfd->failures = 0;
+        vfd->breaker = BREAKER_CLOSED;
+        return;
+    }
+
+    vfd->telemetry.modbus_errors++;
+    vfd->failures++;
+    if (vfd->breaker == BREAKER_HALF_OPEN ||
+        vfd->failures >= vfd->policy.breaker_threshold) {
+        open_breaker(vfd);
+        return;
+    }
+
+    /* Give up until the next cycle, when the budget is spent */
+    if (retry->failures >= vfd->policy.budget[op]) {
+        retry->pending = 0;
+        retry->failures = 0;
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &retry->retry_at);
+    timespec_add(&retry->retry_at,
+                 fmin(ldexp(vfd->policy.delay, retry->failures),
+                      vfd->policy.probe_period));
+    retry->failures++;
+    retry->pending = 1;
+}
+
+/**
+ * @brief Send a probe to the vfd, while the circuit breaker is open.
+ *
+ * If the vfd answers, normal traffic is tried again.
+ *
+ * @param vfd Connection to vfd.
+ */
+static void probe_vfd(struct vfd *vfd)
+{
+    if (read_block(vfd, &vfd->fast) == 0) {
+        printf("%s: vfd is responding again\n", vfd->name);
+        vfd->breaker = BREAKER_HALF_OPEN;
+        vfd->failures = 0;
+        return;
+    }
+    vfd->telemetry.modbus_errors++;
+    clock_gettime(CLOCK_MONOTONIC, &vfd->probe_at);
+    timespec_add(&vfd->probe_at, vfd->policy.probe_period);
+}
+
+/**
+ * @brief Find when the I/O loop must wake up for a retry or a probe.
+ * @param vfd Connection to vfd.
+ * @return Time of the next retry or probe, NULL if there are none.
+ */
+static const struct timespec *next_retry(struct vfd *vfd)
+{
+    const struct timespec *next = NULL;
+    int op;
+
+    if (vfd->breaker == BREAKER_OPEN)
+        return &vfd->probe_at;
+
+    for (op = 0; op < NUM_OPS; op++) {
+        if (vfd->retry[op].pending &&
+            (!next || timespec_diff(&vfd->retry[op].retry_at, next) < 0))
+            next = &vfd->retry[op].retry_at;
+    }
+    return next;
+}
+
+/**
+ * @brief Run the retries and probes that are due.
+ * @param vfd Connection to vfd.
+ */
+static void run_retries(struct vfd *vfd)
+{
+    struct timespec now;
+    int op;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (vfd->breaker == BREAKER_OPEN) {
+        if (timespec_diff(&now, &vfd->probe_at) >= 0)
+            probe_vfd(vfd);
+        return;
+    }
+
+    for (op = 0; op < NUM_OPS; op++) {
+        if (vfd->retry[op].pending &&
+            timespec_diff(&now, &vfd->retry[op].retry_at) >= 0)
+            do_op(vfd, op);
+    }
+}
+
+/**
+ * @brief Check if the slow group is due to be read.
+ * @param vfd Connection to vfd.
+ * @return 1 if it is due, otherwise 0.
+ */
+static int slow_data_due(struct vfd *vfd)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (vfd->num_slow == 0 || timespec_diff(&now, &vfd->slow_deadline) < 0)
+        return 0;
+
+    vfd->slow_deadline = now;
+    timespec_add(&vfd->slow_deadline, vfd->cmd.slow_period);
+    return 1;
+}
+
+/**
+ * @brief Read data from, and write commands to vfd.
+ *
+ * When the vfd supports it, commands and the fast group are exchanged in
+ * one transaction. Otherwise the fast group is read first, then the commands
+ * are written. The slow group is read last, when it is due. Operations that
+ * fail are retried later, without holding up this cycle. In event driven
+ * mode, a pending stop is written first, and not again in the same cycle.
+ *
+ * @param vfd Connection to vfd.
+ */
+static void transfer_data(struct vfd *vfd)
+{
+    int op, stopped = 0;
+
+    if (vfd->breaker == BREAKER_OPEN) {
+        run_retries(vfd);
+        return;
+    }
+
+    /* This cycle replaces the retries from the previous one */
+    for (op = 0; op < NUM_OPS; op++) {
+        vfd->retry[op].pending = 0;
+        vfd->retry[op].failures = 0;
+    }
+
+    count_suppressed_writes(vfd);
+
+    /* A stop goes before anything else, if it fails it is left to the retry */
+    if (stop_pending(vfd)) {
+        do_op(vfd, OP_WRITE);
+        stopped = 1;
+    }
+
+    if (vfd->combined_rw == COMBINED_RW_OFF) {
+        do_op(vfd, OP_READ);
+        if (!stopped)
+            do_op(vfd, OP_WRITE);
+    } else if (!stopped && command_pending(vfd)) {
+        do_op(vfd, OP_WRITE);
+    } else {
+        do_op(vfd, OP_READ);
+    }
+
+    if (slow_data_due(vfd))
+        do_op(vfd, OP_READ_SLOW);
+}
+
+/**
+ * @brief Split the registers in a fast and a slow group, and coalesce each
+ *        group into as few block reads as possible.
+ *
+ * The fast group is read as one block, from the first to the last register
+ * in @p fast_mask, so it can be read in the same transaction as a write.
+ * The registers outside of it make up the slow group, each run of
+ * consecutive addresses is read as one block. The status and the output
+ * frequency are always in the fast group, everything that controls the vfd
+ * or reports its speed goes by them.
+ *
+ * @param vfd Connection to vfd.
+ * @param fast_mask Bit n set for registers[n], checked by check_fast_mask().
+ */
+static void setup_poll_groups(struct vfd *vfd, unsigned int fast_mask)
+{
+    struct register_block *block = NULL;
+    int first = 0;
+    int last = NUM_REGISTER_READ - 1;
+    int i;
+
+    while (!(fast_mask & (1u << first)))
+        first++;
+    while (!(fast_mask & (1u << last)))
+        last--;
+
+    vfd->fast.addr = registers[first].addr;
+    vfd->fast.nb = registers[last].addr - registers[first].addr + 1;
+    vfd->fast.index = first;
+
+    vfd->num_slow = 0;
+    for (i = 0; i < NUM_REGISTER_READ; i++) {
+        if (i >= first && i <= last) {
+            block = NULL;
+        } else if (block && registers[i].addr == block->addr + block->nb &&
+                   block->nb < MODBUS_MAX_READ_REGISTERS) {
+            block->nb++;
+        } else {
+            block = &vfd->slow[vfd->num_slow++];
+            block->addr = registers[i].addr;
+            block->nb = 1;
+            block->index = i;
+        }
+    }
+}
+
+/**
+ * @brief Find the time it takes to send one character on the serial bus.
+ * @param baud Baud rate.
+ * @param parity 'N', 'E' or 'O'.
+ * @param bits Number of data bits.
+ * @param stopbits Number of stop bits.
+ * @return Time of one character (s).
+ */
+static double get_char_time(int baud, char parity, int bits, int stopbits)
+{
+    /* Start bit, data bits, parity bit and stop bits */
+    return (1 + bits + (parity != 'N') + stopbits) / (double) baud;
+}
+
+/**
+ * @brief Measure the time the vfd takes to answer a request.
+ *
+ * A few reads are timed, and the time on the wire is subtracted. What's
+ * left is the time the vfd spends on the request, plus the latency of the
+ * serial adapter. The slowest read is used, since the latency of adapters
+ * on USB varies from read to read, and the timeouts are computed from it.
+ *
+ * @param vfd Connection to vfd.
+ * @return Turnaround time (s), or -1 if the vfd didn't answer.
+ */
+static double measure_turnaround(struct vfd *vfd)
+{
+    uint16_t receive_data[MODBUS_MAX_READ_REGISTERS];
+    struct timespec start, end;
+    double wire_time, elapsed;
+    double turnaround = -1;
+    int i;
+
+    wire_time = (READ_REQUEST_SIZE + READ_RESPONSE_SIZE(vfd->fast.nb)) *
+                vfd->char_time;
+
+    for (i = 0; i < NUM_TURNAROUND_SAMPLES && !done; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (bus_read_registers(vfd->bus, vfd->fast.addr, vfd->fast.nb,
+                               receive_data) != vfd->fast.nb)
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        elapsed = fmax(timespec_diff(&end, &start) - wire_time, 0.0);
+        turnaround = fmax(turnaround, elapsed);
+    }
+    return turnaround;
+}
+
+/**
+ * @brief Find suitable timeouts, from the baud rate and the turnaround of
+ *        the vfd.
+ *
+ * @param vfd Connection to vfd.
+ * @param response_timeout Time to wait for the first byte of an answer (s).
+ * @param byte_timeout Time to wait between bytes of an answer (s).
+ */
+static void compute_timeouts(struct vfd *vfd, double *response_timeout,
+                             double *byte_timeout)
+{
+    /*
+     * libmodbus starts waiting as soon as the request is queued, so the
+     * longest request must be sent, followed by the silence that ends the
+     * frame, before the vfd starts working on it.
+     */
+    *response_timeout = (MAX_REQUEST_SIZE + 3.5) * vfd->char_time +
+                        2 * vfd->turnaround + TIMEOUT_SLACK;
+
+    /*
+     * Serial adapters on USB deliver bytes in bursts, so a gap within a
+     * frame can be as long as their latency. Twice the turnaround leaves
+     * room for latency beyond the slowest sample, like the response timeout.
+     */
+    *byte_timeout = 3.5 * vfd->char_time + 2 * vfd->turnaround + TIMEOUT_SLACK;
+}
+
+/**
+ * @brief Set the Modbus timeouts.
+ * @param vfd Connection to vfd.
+ * @param response_timeout Time to wait for the first byte of an answer (s).
+ * @param byte_timeout Time to wait between bytes of an answer (s).
+ */
+static void set_timeouts(struct vfd *vfd, double response_timeout,
+                         double byte_timeout)
+{
+    if (bus_set_timeouts(vfd->bus, response_timeout, byte_timeout) != 0)
+        fprintf(stderr, "%s: ERROR setting timeouts: %s\n",
+                vfd->name, modbus_strerror(errno));
+
+    vfd->response_timeout = response_timeout;
+    vfd->byte_timeout = byte_timeout;
+}
+
+/**
+ * @brief Set the Modbus timeouts, if they have been changed from HAL.
+ * @param vfd Connection to vfd.
+ */
+static void update_timeouts(struct vfd *vfd)
+{
+    if (vfd->cmd.response_timeout != vfd->response_timeout ||
+        vfd->cmd.byte_timeout != vfd->byte_timeout)
+        set_timeouts(vfd, vfd->cmd.response_timeout, vfd->cmd.byte_timeout);
+}
+
+/**
+ * @brief Read the latency timer of an FTDI serial adapter.
+ *
+ * The adapter holds back received bytes for up to this long, unless its
+ * buffer fills up.
+ *
+ * @param device Serial device node, or a link to it.
+ * @return Latency timer (ms), or -1 if the device has none.
+ */
+static int get_latency_timer(const char *device)
+{
+    char path[PATH_MAX];
+    char *node;
+    FILE *file;
+    int latency = -1;
+
+    node = realpath(device, NULL);
+    if (node == NULL)
+        return -1;
+    snprintf(path, sizeof(path), "/sys/bus/usb-serial/devices/%s/latency_timer",
+             strrchr(node, '/') + 1);
+    free(node);
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    if (fscanf(file, "%d", &latency) != 1)
+        latency = -1;
+    fclose(file);
+    return latency;
+}
+
+/**
+ * @brief Find the link in SERIAL_BY_ID that points at @p device.
+ *
+ * The links are named after the adapter and its serial number, so they
+ * follow the adapter when it comes back under another ttyUSB name.
+ *
+ * @param device Serial device node, or a link to it.
+ * @param path Room for the link.
+ * @param size Size of @p path.
+ * @return 0 if found, otherwise -1.
+ */
+static int find_stable_device(const char *device, char *path, size_t size)
+{
+    char target[PATH_MAX], link[PATH_MAX], node[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir;
+    int retval = -1;
+
+    if (realpath(device, target) == NULL)
+        return -1;
+    dir = opendir(SERIAL_BY_ID);
+    if (dir == NULL)
+        return -1;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(link, sizeof(link), "%s/%s", SERIAL_BY_ID, entry->d_name);
+        if (realpath(link, node) != NULL && strcmp(node, target) == 0) {
+            snprintf(path, size, "%s", link);
+            retval = 0;
+            break;
+        }
+    }
+    closedir(dir);
+    return retval;
+}
+
+/**
+ * @brief Ask the serial driver to pass on received bytes right away.
+ *
+ * Sets @c ASYNC_LOW_LATENCY on the port. Recent ftdi_sio drivers lower
+ * the latency timer of the adapter to 1 ms when it is set.
+ *
+ * @param bus Serial bus, connected.
+ * @return 0 on success, otherwise -1.
+ */
+static int set_low_latency(struct vfd_bus *bus)
+{
+    struct serial_struct serial;
+    int fd = modbus_get_socket(bus->mb_ctx);
+
+    if (ioctl(fd, TIOCGSERIAL, &serial) != 0)
+        return -1;
+    serial.flags |= ASYNC_LOW_LATENCY;
+    return ioctl(fd, TIOCSSERIAL, &serial);
+}
+
+/**
+ * @brief Set how the direction of the RS485 transceiver is switched.
+ *
+ * In kernel mode, libmodbus enables RS485 mode in the serial driver, and
+ * the driver raises RTS while sending. In RTS modes, RTS is switched
+ * around each request by libmodbus, or by the built-in transport.
+ *
+ * @param bus Serial bus, connected.
+ * @param mode How the direction is switched.
+ * @param rts_delay Time RTS is held before and after sending (s), or
+ *                  negative for the default of the driver or libmodbus.
+ * @return 0 on success, otherwise -1.
+ */
+static int set_rs485_mode(struct vfd_bus *bus, enum rs485_mode mode,
+                          double rts_delay)
+{
+    struct serial_rs485 rs485;
+    int fd = modbus_get_socket(bus->mb_ctx);
+
+    switch (mode) {
+    case RS485_KERNEL:
+        if (modbus_rtu_set_serial_mode(bus->mb_ctx, MODBUS_RTU_RS485) != 0 ||
+            ioctl(fd, TIOCGRS485, &rs485) != 0)
+            return -1;
+        rs485.flags |= SER_RS485_RTS_ON_SEND;
+        rs485.flags &= ~SER_RS485_RTS_AFTER_SEND;
+        if (rts_delay >= 0) {
+            rs485.delay_rts_before_send = (uint32_t) ceil(rts_delay * 1000);
+            rs485.delay_rts_after_send = rs485.delay_rts_before_send;
+        }
+        return ioctl(fd, TIOCSRS485, &rs485);
+    case RS485_RTS_UP:
+    case RS485_RTS_DOWN:
+        if (modbus_rtu_set_rts(bus->mb_ctx, mode == RS485_RTS_UP ?
+                               MODBUS_RTU_RTS_UP : MODBUS_RTU_RTS_DOWN) != 0)
+            return -1;
+        if (rts_delay >= 0 &&
+            modbus_rtu_set_rts_delay(bus->mb_ctx, (int) (rts_delay * 1000000)) != 0)
+            return -1;
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Set low latency mode on a bus, and log what it changed.
+ *
+ * The turnaround of the first vfd on the bus is measured before and after.
+ *
+ * @param bus Serial bus, connected.
+ * @param vfd First vfd on @p bus, selected.
+ */
+static void apply_low_latency(struct vfd_bus *bus, struct vfd *vfd)
+{
+    double before, after;
+    int latency_timer;
+
+    before = measure_turnaround(vfd);
+    if (set_low_latency(bus) != 0) {
+        fprintf(stderr, "%s: WARNING: couldn't set low latency mode on %s: %s\n",
+                modname, bus->device, strerror(errno));
+        return;
+    }
+    after = measure_turnaround(vfd);
+
+    latency_timer = get_latency_timer(bus->device);
+    if (latency_timer >= 0)
+        printf("%s: latency timer of %s is now %d ms\n", modname, bus->device,
+               latency_timer);
+    if (before >= 0 && after >= 0)
+        printf("%s: turnaround %.1f ms before low latency mode, %.1f ms after\n",
+               vfd->name, before * 1000, after * 1000);
+}
+
+/**
+ * @brief Open the serial port of a bus, and set it up.
+ *
+ * Used on startup, and again when a lost port is reopened, so everything
+ * it needs is kept in @p bus.
+ *
+ * @param bus Serial bus, with the port closed.
+ * @param report Print why it failed.
+ * @return 0 on success, otherwise -1.
+ */
+static int connect_bus(struct vfd_bus *bus, int report)
+{
+    if (modbus_connect(bus->mb_ctx) != 0) {
+        if (report)
+            fprintf(stderr, "%s: ERROR: Couldn't open serial device %s: %s\n",
+                    modname, bus->device, modbus_strerror(errno));
+        return -1;
+    }
+
+    modbus_set_debug(bus->mb_ctx, bus->verbose);
+
+    if (set_rs485_mode(bus, bus->rs485_mode, bus->rts_delay) != 0) {
+        if (report)
+            fprintf(stderr, "%s: ERROR: Couldn't set RS485 mode on %s: %s\n",
+                    modname, bus->device, modbus_strerror(errno));
+        goto fail;
+    }
+
+    if (bus->rtu) {
+        if (rtu_init(bus->rtu, bus->mb_ctx, bus->char_time, bus->verbose) != 0) {
+            if (report)
+                fprintf(stderr, "%s: ERROR: Couldn't set up serial device %s: %s\n",
+                        modname, bus->device, strerror(errno));
+            goto fail;
+        }
+        bus->rtu->rts = modbus_rtu_get_rts(bus->mb_ctx);
+        bus->rtu->rts_delay = modbus_rtu_get_rts_delay(bus->mb_ctx) * 1e-6;
+        rtu_set_rts(bus->rtu, 0);
+    }
+
+    bus->port = PORT_OPEN;
+    return 0;
+
+fail:
+    modbus_close(bus->mb_ctx);
+    return -1;
+}
+
+/**
+ * @brief Add a sample of the output frequency to the ramp model.
+ *
+ * A rate is only learned from an interval in the middle of a ramp, when
+ * the speed changed the same way over the interval before, and the ramp
+ * hasn't ended yet. Otherwise the ramp could have started or ended between
+ * the samples, and the rate would come out too low.
+ *
+ * @param model Ramp model.
+ * @param freq Output frequency (Hz), negative in reverse.
+ * @param time CLOCK_MONOTONIC time of the sample (s).
+ * @param end Frequency the vfd is ramping to, from its reference (Hz).
+ * @param tolerance Relative tolerance of at-speed.
+ */
+static void ramp_learn(struct ramp_model *model, double freq, double time,
+                       double end, double tolerance)
+{
+    double dt = time - model->time;
+    double change = fabs(freq) - fabs(model->freq);
+    double *rate = change > 0 ? &model->accel : &model->decel;
+    int ramping;
+
+    ramping = fabs(freq) > RAMP_MIN_FREQ &&
+              fabs(fabs(freq) - end) > end * tolerance;
+    if (model->time > 0 && dt > 0 && change != 0 && ramping &&
+        (change > 0) == (model->change > 0) && model->change != 0) {
+        if (*rate == 0)
+            *rate = fabs(change) / dt;
+        else
+            *rate += RAMP_EWMA_WEIGHT * (fabs(change) / dt - *rate);
+    }
+
+    model->change = dt > 0 ? change : 0;
+    model->slope = dt > 0 ? (freq - model->freq) / dt : 0;
+    model->freq = freq;
+    model->time = time;
+}
+
+/**
+ * @brief Interpolate the output frequency at @p time, from the last sample.
+ *
+ * The ramp starts at the last sample, or when the command changed, if it
+ * changed after. When the direction is reversed, the vfd ramps down to 0
+ * first. The frequency is left at the last sample while a rate it needs
+ * isn't learned yet.
+ *
+ * @param model Ramp model.
+ * @param time CLOCK_MONOTONIC time (s).
+ * @return Output frequency (Hz), negative in reverse.
+ */
+static double ramp_predict(const struct ramp_model *model, double time)
+{
+    double freq = model->freq, target = model->target;
+    double elapsed = time - fmax(model->time, model->target_time);
+    double rate, step;
+
+    if (elapsed <= 0)
+        return freq;
+
+    if (freq * target < 0) {
+        if (model->decel <= 0)
+            return freq;
+        if (elapsed < fabs(freq) / model->decel)
+            return freq - copysign(model->decel * elapsed, freq);
+        elapsed -= fabs(freq) / model->decel;
+        freq = 0;
+    }
+
+    rate = fabs(target) > fabs(freq) ? model->accel : model->decel;
+    if (rate <= 0)
+        return freq;
+    step = rate * elapsed;
+    if (step >= fabs(target - freq))
+        return target;
+    return freq + copysign(step, target - freq);
+}
+
+/**
+ * @brief Extrapolate the output frequency from the last sample, for a
+ *        smooth speed feedback between polls.
+ *
+ * The learned ramp is followed when both rates are known. Before that, the
+ * slope between the last two samples is, but never past the target. The
+ * frequency is held at what it was @p limit after the last sample.
+ *
+ * @param model Ramp model.
+ * @param time CLOCK_MONOTONIC time (s).
+ * @param limit Longest time to extrapolate past the last sample (s).
+ * @return Output frequency (Hz), negative in reverse.
+ */
+static double ramp_extrapolate(const struct ramp_model *model, double time,
+                               double limit)
+{
+    double freq;
+
+    time = fmin(time, model->time + limit);
+    if (model->accel > 0 && model->decel > 0)
+        return ramp_predict(model, time);
+
+    /* Only while the last two samples were heading for the target */
+    if ((model->target - model->freq) * model->slope <= 0)
+        return model->freq;
+    freq = model->freq + model->slope * (time - model->time);
+    if ((model->target - freq) * model->slope < 0)
+        return model->target;
+    return freq;
+}
+
+/**
+ * @brief Find the time until the vfd is at speed, by the ramp model.
+ *
+ * The speed is at speed like for the at-speed pin, when the ratio of the
+ * target to the output frequency is within @p tolerance of 1.
+ *
+ * @param model Ramp model.
+ * @param freq Output frequency now (Hz), from ramp_predict().
+ * @param tolerance Relative tolerance of at-speed.
+ * @return Time (s), 0 if at speed, or -1 if a rate isn't learned yet.
+ */
+static double ramp_time_to_target(const struct ramp_model *model,
+                                  double freq, double tolerance)
+{
+    double target = fabs(model->target);
+    double low = target / (1 + tolerance);
+    double high = tolerance < 1 ? target / (1 - tolerance) : INFINITY;
+    double time = 0;
+
+    if (freq * model->target < 0) {
+        if (model->decel <= 0)
+            return -1;
+        time = fabs(freq) / model->decel;
+        freq = 0;
+    }
+
+    freq = fabs(freq);
+    if (freq < low) {
+        if (model->accel <= 0)
+            return -1;
+        return time + (low - freq) / model->accel;
+    }
+    if (freq > high) {
+        if (model->decel <= 0)
+            return -1;
+        return time + (freq - high) / model->decel;
+    }
+    return time;
+}
+
+/**
+ * @brief Predict at-speed from the learned ramp.
+ *
+ * at-speed has to wait for a poll that sees the vfd at speed. The ramp
+ * model learns how fast the vfd ramps, and interpolates the frequency
+ * between polls, so predicted-at-speed follows the vfd without that wait.
+ * Until the rates are learned, it falls back on at-speed.
+ *
+ * @param haldata HAL pins of the vfd, with at-speed updated.
+ * @param vfd Connection to vfd.
+ * @param now CLOCK_MONOTONIC time (s).
+ */
+static void predict_at_speed(struct haldata *haldata, const struct vfd *vfd,
+                             double now)
+{
+    struct ramp_model *model = &haldata->ramp;
+    double freq, target, time;
+
+    if (*haldata->read_time != model->time) {
+        freq = *haldata->output_freq;
+        if ((*haldata->inverter_status & 3) == VFD_CCW)
+            freq = -freq;
+        ramp_learn(model, freq, *haldata->read_time, *haldata->freq_cmd,
+                   haldata->speed_tolerance);
+    }
+
+    target = 0;
+    if (*haldata->spindle_on) {
+        target = fmin(fabs(*haldata->speed_cmd) * vfd->freq_calc,
+                      vfd->max_freq);
+        if (*haldata->spindle_rev && !*haldata->spindle_fwd)
+            target = -target;
+    }
+    if (target != model->target) {
+        model->target = target;
+        model->target_time = now;
+    }
+
+    haldata->accel = model->accel;
+    haldata->decel = model->decel;
+
+    if (!*haldata->spindle_on || *haldata->telemetry_stale ||
+        !*haldata->comm_ok) {
+        *haldata->predicted_at_speed = 0;
+        *haldata->time_to_at_speed = 0;
+        return;
+    }
+
+    time = ramp_time_to_target(model, ramp_predict(model, now),
+                               haldata->speed_tolerance);
+    *haldata->time_to_at_speed = time;
+    if (time < 0)
+        *haldata->predicted_at_speed = *haldata->at_speed;
+    else
+        *haldata->predicted_at_speed = time == 0;
+}
+
+/* Set HAL pins calculated from data read from vfd */
+static void update_status(struct haldata *haldata, const struct vfd *vfd)
+{
+    double hzcalc = vfd->freq_calc;
+    struct timespec now;
+
+    if (*haldata->output_freq == 0) {
+        *haldata->is_stopped = 1;
+    } else {
+        *haldata->is_stopped = 0;
+    }
+
+    *haldata->speed_fb = *haldata->output_freq / hzcalc;
+
+    /* Calculates in % difference between set and actual frequency */
+    if (fabs(1 - (*haldata->freq_cmd / *haldata->output_freq)) < haldata->speed_tolerance) {
+        *haldata->at_speed = 1;
+    } else {
+        *haldata->at_speed = 0;
+    }
+
+    if (*haldata->spindle_on == 0)
+        *haldata->at_speed = 0;
+
+    /* Don't claim at-speed from values that are too old to trust */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *haldata->telemetry_age = now.tv_sec + now.tv_nsec * 1e-9 -
+                              *haldata->read_time;
+    *haldata->telemetry_stale = haldata->stale_limit > 0 &&
+                                *haldata->telemetry_age > haldata->stale_limit;
+    if (*haldata->telemetry_stale || !*haldata->comm_ok)
+        *haldata->at_speed = 0;
+
+    predict_at_speed(haldata, vfd, now.tv_sec + now.tv_nsec * 1e-9);
+
+    /* Smooth the steps between polls, for users in a faster thread */
+    if (haldata->max_extrapolation > 0 && !*haldata->telemetry_stale)
+        *haldata->speed_fb = fabs(ramp_extrapolate(&haldata->ramp,
+                                      now.tv_sec + now.tv_nsec * 1e-9,
+                                      haldata->max_extrapolation)) / hzcalc;
+
+    if ((*haldata->inverter_status & 24) != 0)
+        *haldata->vfd_error = 1;
+}
+
+/**
+ * @brief Pass information from the I/O loop on to HAL.
+ *
+ * The HAL pins are set directly, or in threaded mode, passed on to the HAL
+ * loop through @c vfd->exchange.
+ *
+ * @param vfd Connection to vfd.
+ */
+static void publish(struct vfd *vfd)
+{
+    struct vfd_exchange *exchange = vfd->exchange;
+
+    vfd->telemetry.breaker_state = vfd->breaker;
+    vfd->telemetry.comm_ok = vfd->bus->port == PORT_OPEN &&
+                             vfd->breaker != BREAKER_OPEN;
+
+    if (!exchange) {
+        publish_telemetry(vfd->haldata, &vfd->telemetry);
+        update_status(vfd->haldata, vfd);
+    } else {
+        exchange->telemetry[exchange->telemetry_buffer.write] = vfd->telemetry;
+        triple_buffer_publish(&exchange->telemetry_buffer);
+    }
+}
+
+/**
+ * @brief Address the following transactions on the bus to @p vfd.
+ * @param vfd Connection to vfd.
+ */
+static void select_vfd(struct vfd *vfd)
+{
+    bus_set_slave(vfd->bus, vfd->target);
+    set_timeouts(vfd, vfd->response_timeout, vfd->byte_timeout);
+}
+
+/**
+ * @brief Find the vfd that is due to be polled first.
+ *
+ * When several vfds are due at the same time, they take turns being first.
+ *
+ * @param bus Serial bus, with the vfds on it.
+ * @return The vfd with the earliest deadline.
+ */
+static struct vfd *next_vfd(struct vfd_bus *bus)
+{
+    struct vfd *vfd, *next = NULL;
+    int i;
+
+    for (i = 0; i < bus->num_vfds; i++) {
+        vfd = &bus->vfd[(bus->next + i) % bus->num_vfds];
+        loop_timer_arm(&vfd->timer, vfd->cmd.period);
+        if (!next || timespec_diff(&vfd->timer.deadline,
+                                   &next->timer.deadline) < 0)
+            next = vfd;
+    }
+    return next;
+}
+
+/**
+ * @brief Find when the I/O loop must wake up for a retry or a probe, on
+ *        any of the vfds.
+ * @param bus Serial bus, with the vfds on it.
+ * @return Time of the next retry or probe, NULL if there are none.
+ */
+static const struct timespec *next_bus_retry(struct vfd_bus *bus)
+{
+    const struct timespec *retry, *next = NULL;
+    int i;
+
+    for (i = 0; i < bus->num_vfds; i++) {
+        retry = next_retry(&bus->vfd[i]);
+        if (retry && (!next || timespec_diff(retry, next) < 0))
+            next = retry;
+    }
+    return next;
+}
+
+/**
+ * @brief Take over the latest commands, from the HAL loop in threaded mode,
+ *        otherwise from the HAL pins.
+ * @param vfd Connection to vfd.
+ */
+static void take_command(struct vfd *vfd)
+{
+    if (vfd->exchange)
+        fetch_command(vfd);
+    else
+        sample_command(vfd->haldata, &vfd->cmd);
+}
+
+/**
+ * @brief Send a new state to all vfds on the bus at once.
+ *
+ * Only done when every vfd on the bus is to get the same new state. The
+ * state is written to the broadcast address, which the vfds don't answer,
+ * so the transaction times out once they have had time to act on it. Each
+ * vfd is then asked for its status, for the next check of the state, and
+ * for its instruction register. The instruction register holds the new
+ * state as soon as the vfd has taken it, while the status keeps showing run
+ * until a stop has ramped down. Only a vfd whose instruction register shows
+ * the new state counts it as written. Any other vfd, or one with its breaker
+ * open, is sent the state again by the usual write, on its next poll.
+ *
+ * @param bus Serial bus, with the vfds on it.
+ */
+static void broadcast_state(struct vfd_bus *bus)
+{
+    struct vfd *vfd;
+    struct register_block status = { VFD_STATUS, 1, status_index };
+    uint16_t state, target, instruction;
+    double turnaround = 0;
+    double timeout;
+    int i, pending = 0;
+
+    for (i = 0; i < bus->num_vfds; i++) {
+        vfd = &bus->vfd[i];
+        take_command(vfd);
+        if (!get_target_state(&vfd->cmd, &target) || (i > 0 && target != state))
+            return;
+        state = target;
+        pending |= get_vfd_state(vfd, &target);
+        turnaround = fmax(turnaround, vfd->turnaround);
+    }
+    if (!pending)
+        return;
+
+    /* Send the request, and give the vfds time to act on it */
+    vfd = &bus->vfd[0];
+    timeout = (WRITE_REQUEST_SIZE(1) + 3.5) * vfd->char_time + turnaround +
+              TIMEOUT_SLACK;
+    bus_set_slave(bus, MODBUS_BROADCAST_ADDRESS);
+    bus_set_timeouts(bus, timeout, vfd->byte_timeout);
+    if (bus_write_registers(bus, VFD_INSTRUCTION, 1, &state) != 1 &&
+        errno != ETIMEDOUT) {
+        fprintf(stderr, "%s: ERROR broadcasting %u to register 0x%04x: %s\n",
+                modname, state, VFD_INSTRUCTION, modbus_strerror(errno));
+        return;
+    }
+
+    for (i = 0; i < bus->num_vfds; i++) {
+        vfd = &bus->vfd[i];
+        if (vfd->breaker == BREAKER_OPEN)
+            continue;
+
+        select_vfd(vfd);
+        if (read_block(vfd, &status) != 0) {
+            vfd->telemetry.modbus_errors++;
+            instruction = ~state;
+        } else if (bus_read_registers(bus, VFD_INSTRUCTION, 1,
+                                      &instruction) != 1) {
+            print_error(vfd, "reading back register 0x%04x", VFD_INSTRUCTION);
+            vfd->telemetry.modbus_errors++;
+            instruction = ~state;
+        }
+        update_shadow(&vfd->shadow, VFD_INSTRUCTION, 1, &state,
+                      instruction == state);
+        publish(vfd);
+    }
+}
+
+/**
+ * @brief Run one polling cycle of @p vfd.
+ * @param vfd Connection to vfd.
+ */
+static void poll_vfd(struct vfd *vfd)
+{
+    double cycle_time;
+
+    cycle_time = loop_timer_cycle(&vfd->timer);
+
+    take_command(vfd);
+    select_vfd(vfd);
+    update_timeouts(vfd);
+    check_stats_reset(vfd);
+
+    vfd->telemetry.cycle_time = cycle_time;
+    if (cycle_time > vfd->telemetry.max_cycle_time)
+        vfd->telemetry.max_cycle_time = cycle_time;
+    vfd->telemetry.wakeup_jitter = vfd->timer.late;
+    if (vfd->timer.late > vfd->telemetry.max_wakeup_jitter)
+        vfd->telemetry.max_wakeup_jitter = vfd->timer.late;
+
+    transfer_data(vfd);
+
+    if (loop_timer_overrun(&vfd->timer, vfd->cmd.period))
+        vfd->telemetry.overruns++;
+
+    publish(vfd);
+}
+
+/**
+ * @brief Check if all vfds report the state requested on the group pins.
+ * @param group Pins shared by all vfds.
+ * @param buses Serial buses, with the vfds on them.
+ * @param num_buses Number of buses.
+ */
+static void update_group(struct hal_group *group, struct vfd_bus *buses,
+                         int num_buses)
+{
+    const struct vfd_command *cmd;
+    struct vfd *vfd;
+    uint16_t state;
+    int b, i, confirmed = 1;
+
+    for (b = 0; b < num_buses; b++) {
+        for (i = 0; i < buses[b].num_vfds; i++) {
+            vfd = &buses[b].vfd[i];
+            cmd = vfd->exchange ? &vfd->exchange->last_cmd : &vfd->cmd;
+            confirmed &= get_target_state(cmd, &state) &&
+                state_reached(*vfd->haldata->inverter_status, state);
+        }
+    }
+    *group->confirmed = confirmed;
+}
+
+/**
+ * @brief Give the calling I/O loop real-time priority, and pin it to a CPU.
+ *
+ * Failures are only warned about, the driver works without them, but the
+ * wakeup jitter is likely to be worse.
+ *
+ * @param bus Serial bus, serviced by the calling I/O loop.
+ */
+static void setup_scheduling(const struct vfd_bus *bus)
+{
+    struct sched_param param = { .sched_priority = bus->priority };
+    cpu_set_t cpus;
+    int retval;
+
+    if (bus->priority > 0) {
+        retval = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (retval == EPERM)
+            fprintf(stderr, "%s: WARNING: not allowed to use SCHED_FIFO priority %d for %s, run as root, or raise rtprio in /etc/security/limits.conf\n",
+                    modname, bus->priority, bus->device);
+        else if (retval != 0)
+            fprintf(stderr, "%s: WARNING: couldn't set SCHED_FIFO priority %d for %s: %s\n",
+                    modname, bus->priority, bus->device, strerror(retval));
+    }
+
+    if (bus->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(bus->cpu, &cpus);
+        retval = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (retval == EINVAL)
+            fprintf(stderr, "%s: WARNING: CPU %d doesn't exist, or isn't allowed for %s\n",
+                    modname, bus->cpu, bus->device);
+        else if (retval != 0)
+            fprintf(stderr, "%s: WARNING: couldn't run %s on CPU %d: %s\n",
+                    modname, bus->device, bus->cpu, strerror(retval));
+    }
+}
+
+/**
+ * @brief Close a lost serial port, and try to reopen it.
+ *
+ * Called by the I/O loop instead of polling, while the port is lost. The
+ * device is reopened every RECONNECT_PERIOD, until it is back. Then the
+ * settings are restored, and the vfds are treated as if they had lost
+ * power, so all commands are written again.
+ *
+ * @param bus Serial bus, with the port lost or closed.
+ */
+static void reconnect_bus(struct vfd_bus *bus)
+{
+    struct vfd *vfd;
+    int i;
+
+    if (bus->port == PORT_LOST) {
+        fprintf(stderr, "%s: ERROR: lost %s: %s, reconnecting every %g s\n",
+                modname, bus->device, modbus_strerror(bus->port_error),
+                RECONNECT_PERIOD);
+        modbus_close(bus->mb_ctx);
+        bus->port = PORT_CLOSED;
+        for (i = 0; i < bus->num_vfds; i++)
+            publish(&bus->vfd[i]);
+        loop_timer_start(&bus->reconnect_timer);
+    }
+
+    if (loop_timer_sleep(&bus->reconnect_timer, RECONNECT_PERIOD, -1,
+                         NULL) != WAKEUP_DEADLINE)
+        return;
+    if (connect_bus(bus, 0) != 0) {
+        /* Without --threaded, nothing else updates the pins meanwhile */
+        for (i = 0; i < bus->num_vfds; i++)
+            publish(&bus->vfd[i]);
+        return;
+    }
+
+    if (bus->low_latency && set_low_latency(bus) != 0)
+        fprintf(stderr, "%s: WARNING: couldn't set low latency mode on %s: %s\n",
+                modname, bus->device, strerror(errno));
+    printf("%s: reconnected to %s\n", modname, bus->device);
+
+    for (i = 0; i < bus->num_vfds; i++) {
+        vfd = &bus->vfd[i];
+        memset(&vfd->shadow, 0, sizeof(vfd->shadow));
+        loop_timer_start(&vfd->timer);
+        publish(vfd);
+    }
+}
+
+/**
+ * @brief Poll each vfd on the bus once every period, until @c done is set.
+ *
+ * The vfds have their own deadlines, and the one due first is polled
+ * first. Retries, and commands in event driven mode, are sent in between.
+ *
+ * When the bus isn't threaded, the HAL pins are serviced in the same loop.
+ * Otherwise commands and telemetry are exchanged with the HAL loop through
+ * @c vfd->exchange.
+ *
+ * @param bus Serial bus, with the vfds on it.
+ */
+static void io_loop(struct vfd_bus *bus)
+{
+    struct vfd *vfd;
+    int i;
+
+    setup_scheduling(bus);
+    for (i = 0; i < bus->num_vfds; i++)
+        loop_timer_start(&bus->vfd[i].timer);
+
+    while (done == 0) {
+        if (bus->port != PORT_OPEN) {
+            reconnect_bus(bus);
+            continue;
+        }
+
+        vfd = next_vfd(bus);
+        switch (loop_timer_sleep(&vfd->timer, vfd->cmd.period, bus->event_fd,
+                                 next_bus_retry(bus))) {
+        case WAKEUP_EVENT:
+            /* In event driven mode, new commands are sent right away */
+            if (bus->broadcast)
+                broadcast_state(bus);
+            for (i = 0; i < bus->num_vfds; i++) {
+                vfd = &bus->vfd[i];
+                fetch_command(vfd);
+                if (!command_pending(vfd))
+                    continue;
+                select_vfd(vfd);
+                do_op(vfd, OP_WRITE);
+                publish(vfd);
+            }
+            continue;
+        case WAKEUP_TIMEOUT:
+            for (i = 0; i < bus->num_vfds; i++) {
+                vfd = &bus->vfd[i];
+                if (!next_retry(vfd))
+                    continue;
+                select_vfd(vfd);
+                run_retries(vfd);
+                publish(vfd);
+            }
+            continue;
+        case WAKEUP_STOP:
+            continue;
+        case WAKEUP_DEADLINE:
+            break;
+        }
+
+        /* The others get to go first, if they are due at the same time */
+        bus->next = (vfd - bus->vfd + 1) % bus->num_vfds;
+        if (bus->broadcast)
+            broadcast_state(bus);
+        poll_vfd(vfd);
+        if (vfd->haldata->group && !vfd->exchange)
+            update_group(vfd->haldata->group, bus, 1);
+    }
+}
+
+/* Entry point of the I/O thread, in threaded mode */
+static void *io_thread(void *arg)
+{
+    io_loop(arg);
+    return NULL;
+}
+
+/**
+ * @brief Check if a command that is sent to vfd has changed.
+ * @return 1 if changed, otherwise 0.
+ */
+static int command_changed(const struct vfd_command *a,
+                           const struct vfd_command *b)
+{
+    return a->spindle_on != b->spindle_on ||
+           a->spindle_fwd != b->spindle_fwd ||
+           a->spindle_rev != b->spindle_rev ||
+           a->speed_cmd != b->speed_cmd;
+}
+
+/**
+ * @brief Service the HAL pins of one vfd.
+ * @param vfd Connection to vfd, serviced by the I/O thread.
+ * @return 1 if a command has changed, otherwise 0.
+ */
+static int service_hal(struct vfd *vfd)
+{
+    struct vfd_exchange *exchange = vfd->exchange;
+    struct haldata *haldata = vfd->haldata;
+    struct vfd_command *cmd;
+    int changed;
+
+    cmd = &exchange->cmd[exchange->cmd_buffer.write];
+    sample_command(haldata, cmd);
+    triple_buffer_publish(&exchange->cmd_buffer);
+
+    changed = command_changed(cmd, &exchange->last_cmd);
+    exchange->last_cmd = *cmd;
+
+    if (triple_buffer_update(&exchange->telemetry_buffer)) {
+        publish_telemetry(haldata,
+            &exchange->telemetry[exchange->telemetry_buffer.read]);
+    }
+    update_status(haldata, vfd);
+    return changed;
+}
+
+/**
+ * @brief Stop all vfds, before the driver exits.
+ *
+ * Each vfd gets a single attempt, with the timeouts capped at
+ * @c STOP_TIMEOUT, so vfds that don't answer can't hold up the exit. The
+ * built-in transport is told to no longer end its waits on @c stop_fd,
+ * which is readable by now.
+ *
+ * @param buses Serial buses, with the vfds on them.
+ * @param num_buses Number of buses.
+ */
+static void stop_vfds(struct vfd_bus *buses, int num_buses)
+{
+    const uint16_t state = VFD_STOP;
+    struct vfd *vfd;
+    int b, i;
+
+    for (b = 0; b < num_buses; b++) {
+        if (buses[b].port != PORT_OPEN)
+            continue;
+        if (buses[b].rtu)
+            buses[b].rtu->stop_fd = -1;
+        for (i = 0; i < buses[b].num_vfds; i++) {
+            vfd = &buses[b].vfd[i];
+            bus_set_slave(vfd->bus, vfd->target);
+            bus_set_timeouts(vfd->bus, fmin(vfd->response_timeout, STOP_TIMEOUT),
+                             fmin(vfd->byte_timeout, STOP_TIMEOUT));
+            if (write_registers(vfd, VFD_INSTRUCTION, 1, &state) == 0)
+                printf("%s: vfd stopped\n", vfd->name);
+        }
+    }
+}
+
+/**
+ * @brief Service the HAL pins, until @c done is set.
+ *
+ * Runs in threaded mode, while the I/O threads talk to the vfds. It never
+ * waits for a serial bus, changed inputs are passed on to the I/O threads
+ * within @c hal_period. In event driven mode, the I/O thread of a bus is
+ * woken up when a command to one of its vfds changes.
+ *
+ * @param buses Serial buses, with the vfds serviced by the I/O threads.
+ * @param num_buses Number of buses.
+ */
+static void hal_loop(struct vfd_bus *buses, int num_buses)
+{
+    struct haldata *haldata;
+    struct loop_timer timer;
+    double hal_period;
+    uint64_t event = 1;
+    int b, i, changed;
+
+    loop_timer_start(&timer);
+    while (done == 0) {
+        /* The pins of all vfds are serviced at the shortest period */
+        hal_period = 0.1;
+        for (b = 0; b < num_buses; b++) {
+            for (i = 0; i < buses[b].num_vfds; i++) {
+                haldata = buses[b].vfd[i].haldata;
+                if (haldata->hal_period < 0.0001) haldata->hal_period = 0.0001;
+                if (haldata->hal_period > 0.1) haldata->hal_period = 0.1;
+                hal_period = fmin(hal_period, haldata->hal_period);
+            }
+        }
+        loop_timer_sleep(&timer, hal_period, -1, NULL);
+
+        for (b = 0; b < num_buses; b++) {
+            changed = 0;
+            for (i = 0; i < buses[b].num_vfds; i++)
+                changed |= service_hal(&buses[b].vfd[i]);
+
+            if (buses[b].event_fd >= 0 && changed) {
+                if (write(buses[b].event_fd, &event, sizeof(event)) < 0)
+                    fprintf(stderr, "%s: ERROR waking up I/O thread: %s\n",
+                            modname, strerror(errno));
+            }
+        }
+
+        if (buses[0].vfd[0].haldata->group)
+            update_group(buses[0].vfd[0].haldata->group, buses, num_buses);
+    }
+}
+
+/* Command-line options without a short option */
+enum {
+    OPT_COMBINED_RW = 256,
+    OPT_THREADED,
+    OPT_EVENT_DRIVEN,
+    OPT_FAST_REGISTERS,
+    OPT_READ_RETRIES,
+    OPT_WRITE_RETRIES,
+    OPT_RETRY_DELAY,
+    OPT_BREAKER_THRESHOLD,
+    OPT_PROBE_PERIOD,
+    OPT_RESPONSE_TIMEOUT,
+    OPT_BYTE_TIMEOUT,
+    OPT_BROADCAST,
+    OPT_NATIVE_RTU,
+    OPT_LOW_LATENCY,
+    OPT_RS485,
+    OPT_RTS_DELAY,
+    OPT_PRIORITY,
+    OPT_LOCK_MEMORY,
+    OPT_CPU,
+    OPT_BY_ID,
+};
+
+/* Command-line options */
+static struct option long_options[] = {
+    {"device", 1, 0, 'd'},
+    {"name", 1, 0 , 'n'},
+    {"parity", 1, 0, 'p'},
+    {"rate", 1, 0, 'r'},
+    {"verbose", 0, 0, 'v'},
+    {"target", 1, 0, 't'},
+    {"help", 0, 0, 'h'},
+    {"spindle-max-speed", 1, 0, 'S'},
+    {"max-frequency", 1, 0, 'F'},
+    {"combined-rw", 0, 0, OPT_COMBINED_RW},
+    {"threaded", 0, 0, OPT_THREADED},
+    {"event-driven", 0, 0, OPT_EVENT_DRIVEN},
+    {"fast-registers", 1, 0, OPT_FAST_REGISTERS},
+    {"read-retries", 1, 0, OPT_READ_RETRIES},
+    {"write-retries", 1, 0, OPT_WRITE_RETRIES},
+    {"retry-delay", 1, 0, OPT_RETRY_DELAY},
+    {"breaker-threshold", 1, 0, OPT_BREAKER_THRESHOLD},
+    {"probe-period", 1, 0, OPT_PROBE_PERIOD},
+    {"response-timeout", 1, 0, OPT_RESPONSE_TIMEOUT},
+    {"byte-timeout", 1, 0, OPT_BYTE_TIMEOUT},
+    {"broadcast", 0, 0, OPT_BROADCAST},
+    {"native-rtu", 0, 0, OPT_NATIVE_RTU},
+    {"low-latency", 0, 0, OPT_LOW_LATENCY},
+    {"rs485", 1, 0, OPT_RS485},
+    {"rts-delay", 1, 0, OPT_RTS_DELAY},
+    {"priority", 1, 0, OPT_PRIORITY},
+    {"lock-memory", 0, 0, OPT_LOCK_MEMORY},
+    {"cpu", 1, 0, OPT_CPU},
+    {"by-id", 0, 0, OPT_BY_ID},
+    {0,0,0,0}
+};
+
+static char *option_string = "d:n:p:r:vt:hS:F:";
+
+static char *paritystrings[] = {"even", "odd", "none", NULL};
+static char paritychars[] = {'E', 'O', 'N'};
+
+static char *ratestrings[] = {"2400", "4800", "9600", "19200", "38400", NULL};
+
+static void quit(int sig)
+{
+    uint64_t event = 1;
+
+    done = 1;
+
+    /* write() is async-signal-safe, and wakes every loop polling stop_fd */
+    if (stop_fd >= 0 && write(stop_fd, &event, sizeof(event)) < 0)
+        return;
+}
+
+static int match_string(char *string, char **matches)
+{
+    int which, match;
+    unsigned int len;
+    which = 0;
+    match = -1;
+    if ((matches == NULL) || (string == NULL)) return -1;
+    len = strlen(string);
+    while (matches[which] != NULL) {
+        if ((!strncmp(string, matches[which], len)) && (len <= strlen(matches[which]))) {
+            if (match >= 0) return -1;  /* Multiple matches */
+            match = which;
+        }
+        ++which;
+    }
+    return match;
+}
+
+/**
+ * @brief Check that @p fast_mask can be read as one block.
+ *
+ * The registers in it must have consecutive addresses, and no register
+ * between the first and the last of them may be left out. The status and
+ * the output frequency must be in it, the control of the vfd goes by them.
+ * Needs the indices set by check_registers().
+ *
+ * @param fast_mask Bit n set for registers[n].
+ * @return 0 if it can, otherwise -1.
+ */
+static int check_fast_mask(unsigned int fast_mask)
+{
+    int first = 0;
+    int last = NUM_REGISTER_READ - 1;
+    int i;
+
+    if (!(fast_mask & (1u << status_index)) ||
+        !(fast_mask & (1u << output_freq_index)))
+        return -1;
+    while (!(fast_mask & (1u << first)))
+        first++;
+    while (!(fast_mask & (1u << last)))
+        last--;
+
+    for (i = first + 1; i <= last; i++) {
+        if (!(fast_mask & (1u << i)) ||
+            registers[i].addr != registers[i - 1].addr + 1)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check registers[], and find the registers the driver looks at.
+ *
+ * The addresses must be sorted, the pins must be HAL_FLOAT or HAL_S32, and
+ * the fast group must be readable as one block. Each problem is printed.
+ *
+ * @param fast_mask Default fast group, bit n set for registers[n].
+ * @return 0 if registers[] is usable, otherwise -1.
+ */
+static int check_registers(unsigned int fast_mask)
+{
+    int i, retval = 0;
+
+    for (i = 0; i < NUM_REGISTER_READ; i++) {
+        if (i > 0 && registers[i].addr <= registers[i - 1].addr) {
+            fprintf(stderr, "%s: ERROR: register 0x%04x is out of order\n",
+                    modname, registers[i].addr);
+            retval = -1;
+        }
+        if (registers[i].type != HAL_FLOAT && registers[i].type != HAL_S32) {
+            fprintf(stderr, "%s: ERROR: register 0x%04x has an unknown type\n",
+                    modname, registers[i].addr);
+            retval = -1;
+        }
+    }
 
-static char *ratestrings[] = {"2400", "4800", "9600", "19200", "38400", NULL};
+    status_index = find_register(VFD_STATUS);
+    output_freq_index = find_register(VFD_OUTPUT_FREQ);
+    if (status_index < 0 || output_freq_index < 0) {
+        fprintf(stderr, "%s: ERROR: registers 0x%04x and 0x%04x must be read\n",
+                modname, VFD_STATUS, VFD_OUTPUT_FREQ);
+        return -1;
+    }
 
-static void quit(int sig)
-{
-    done = 1;
+    if (retval == 0 && check_fast_mask(fast_mask) != 0) {
+        fprintf(stderr, "%s: ERROR: the fast registers have a gap, a slow "
+                "register among them, or miss 0x%04x or 0x%04x\n", modname,
+                VFD_STATUS, VFD_OUTPUT_FREQ);
+        retval = -1;
+    }
+    return retval;
 }
 
-static int match_string(char *string, char **matches)
+/**
+ * @brief Parse a list of registers to read.
+ *
+ * The list is separated by comma, and each entry is a register address
+ * or a range of addresses, like "0x0500-0x0503,0x0506". The addresses
+ * must be in registers[], and as the registers are read as one block, there
+ * must be no gap in the addresses from the first to the last, and no
+ * register between them left out. The status and the output frequency
+ * must be in the list.
+ *
+ * @param list String to parse.
+ * @param mask Bit n is set for registers[n].
+ * @return 0 on success, -1 if the list is invalid or empty.
+ */
+static int parse_register_list(char *list, unsigned int *mask)
 {
-    int which, match;
-    unsigned int len;
-    which = 0;
-    match = -1;
-    if ((matches == NULL) || (string == NULL)) return -1;
-    len = strlen(string);
-    while (matches[which] != NULL) {
-        if ((!strncmp(string, matches[which], len)) && (len <= strlen(matches[which]))) {
-            if (match >= 0) return -1;  /* Multiple matches */
-            match = which;
+    char *endarg;
+    long first, last;
+    int i;
+
+    *mask = 0;
+    for (;;) {
+        first = strtol(list, &endarg, 0);
+        last = first;
+        if (*endarg == '-')
+            last = strtol(endarg + 1, &endarg, 0);
+        if (endarg == list || last < first || find_register(first) < 0 ||
+            find_register(last) < 0)
+            return -1;
+
+        for (i = 0; i < NUM_REGISTER_READ; i++) {
+            if (registers[i].addr >= first && registers[i].addr <= last)
+                *mask |= 1u << i;
         }
-        ++which;
+
+        if (*endarg == '\0')
+            break;
+        if (*endarg != ',')
+            return -1;
+        list = endarg + 1;
     }
-    return match;
+    return check_fast_mask(*mask);
 }
 
 static void usage(char **argv)
@@ -278,6 +3379,8 @@ static void usage(char **argv)
     printf("Optional arguments:\n");
     printf("   -d, --device <path> (default: /dev/ttyUSB0)\n");
     printf("       Set the name of the serial device to use\n");
+    printf("       Give it once for each RS485 bus, each bus is serviced by its own thread.\n");
+    printf("       The targets given after a device are on that bus.\n");
     printf("   -n, --name <string> (default: nowforever_vfd)\n");
     printf("       Set the name of the HAL module.  The HAL comp name will be set to <string>, and all pin\n");
     printf("       and parameter names will begin with <string>.\n");
@@ -289,12 +3392,68 @@ static void usage(char **argv)
     printf("   -t, --target <n> (default: 1)\n");
     printf("       Set Modbus target number. This must match the device\n");
     printf("       number you set on the Nowforever VFD.\n");
+    printf("       Give it once for each VFD on the bus. With more than one, the pins of each\n");
+    printf("       VFD are named <name>.<n>.*, where <n> counts from 0 in the order given.\n");
     printf("   -S, --spindle-max-speed <f> (default: 24000.0)\n");
     printf("       The spindle's max speed in RPM. This must match the spindle speed value\n");
     printf("        when it is at max frequency\n");
     printf("   -F, --max-frequency <f> (default: 400.0)\n");
     printf("       This is the maximum output frequency of the VFD in Hz. It should correspond\n");
     printf("       to the maximum output value configured in VFD register P0-007\n");
+    printf("   --combined-rw\n");
+    printf("       Write commands and read data in one transaction, using Modbus function 0x17,\n");
+    printf("       if the VFD supports it.\n");
+    printf("   --threaded\n");
+    printf("       Talk to the VFD in a separate thread, so servicing the HAL pins never waits for\n");
+    printf("       the serial bus.\n");
+    printf("   --event-driven\n");
+    printf("       Send changes to spindle-on, spindle-fwd, spindle-rev and speed-command to the\n");
+    printf("       VFD right away, instead of waiting for the next poll. Implies --threaded.\n");
+    printf("   --fast-registers <list> (default: 0x0500-0x0507)\n");
+    printf("       Registers to read every period-seconds, like \"0x0500-0x0503\". They are read\n");
+    printf("       as one block, the other registers are read every slow-period-seconds.\n");
+    printf("       The list must include 0x0500-0x0502, the status and frequencies.\n");
+    printf("   --read-retries <n> (default: %d)\n", NUM_READ_RETRIES);
+    printf("       Retry a failed read <n> times, before waiting for the next period.\n");
+    printf("   --write-retries <n> (default: %d)\n", NUM_WRITE_RETRIES);
+    printf("       Retry a failed write <n> times, before waiting for the next period.\n");
+    printf("   --retry-delay <f> (default: %g)\n", RETRY_DELAY);
+    printf("       Seconds to wait before the first retry, the delay is doubled for each retry.\n");
+    printf("   --breaker-threshold <n> (default: %d)\n", BREAKER_THRESHOLD);
+    printf("       Stop talking to the VFD after <n> failed transactions in a row, and only\n");
+    printf("       probe it until it responds again.\n");
+    printf("   --probe-period <f> (default: %g)\n", PROBE_PERIOD);
+    printf("       Seconds between probes, while the VFD is not responding.\n");
+    printf("   --response-timeout <f> (default: computed)\n");
+    printf("       Seconds to wait for the VFD to answer. By default it is computed from the baud\n");
+    printf("       rate and the turnaround of the VFD, measured on startup.\n");
+    printf("   --byte-timeout <f> (default: computed)\n");
+    printf("       Seconds to wait between bytes of an answer. By default it is computed like\n");
+    printf("       --response-timeout.\n");
+    printf("   --broadcast\n");
+    printf("       Start and stop all VFDs at once, from the <name>.group.* pins, by writing the\n");
+    printf("       state to the Modbus broadcast address.\n");
+    printf("   --native-rtu\n");
+    printf("       Send and receive frames with the built-in Modbus RTU transport, instead of\n");
+    printf("       libmodbus. Each answer is read until it has its known length.\n");
+    printf("   --low-latency\n");
+    printf("       Set ASYNC_LOW_LATENCY on the serial port, so received bytes are passed on\n");
+    printf("       right away. The turnaround is measured before and after.\n");
+    printf("   --rs485 {kernel,rts,rts-down}\n");
+    printf("       Switch the direction of the RS485 transceiver with RTS. kernel lets the serial\n");
+    printf("       driver do it, with TIOCSRS485. rts and rts-down switch RTS around each request,\n");
+    printf("       high or low while sending. By default the adapter switches by itself.\n");
+    printf("   --rts-delay <f> (default: driver or libmodbus default)\n");
+    printf("       Seconds RTS is held before and after sending, with --rs485.\n");
+    printf("   --priority <n>\n");
+    printf("       Run the I/O loop with SCHED_FIFO real-time priority <n>, from 1 to 99.\n");
+    printf("   --lock-memory\n");
+    printf("       Lock all memory of the driver in RAM, with mlockall(), so it's never paged out.\n");
+    printf("   --cpu <n>\n");
+    printf("       Run the I/O loop on CPU <n> only.\n");
+    printf("   --by-id\n");
+    printf("       Open the device by its link in %s, so it's found again when a USB\n", SERIAL_BY_ID);
+    printf("       adapter is plugged back in under another name.\n");
     printf("   -v, --verbose\n");
     printf("       Turn on verbose mode.\n");
     printf("   -h, --help\n");
@@ -302,130 +3461,388 @@ static void usage(char **argv)
 }
 
 /**
- * @brief Create HAL pins.
- * @param haldata Information to and from, LinuxCNC.
+ * @brief Create HAL pins for the latency of one kind of transaction.
+ * @param pins Pins to create.
+ * @param prefix Start of the pin names.
+ * @param name Name of the kind of transaction.
  * @param hal_comp_id Component ID created by HAL.
  * @return 0 on success, -1 on failure.
  */
-static int hal_setup(struct haldata *haldata, int hal_comp_id)
+static int latency_pins_setup(struct latency_pins *pins, const char *prefix,
+                              const char *name, int hal_comp_id)
 {
-    int retval;
+    int retval, bucket;
 
-    retval = hal_pin_s32_newf(HAL_OUT, &haldata->inverter_status,
-                              hal_comp_id, "%s.inverter-status", modname);
+    retval = hal_pin_float_newf(HAL_OUT, &pins->last,
+                                hal_comp_id, "%s.%s.latency", prefix, name);
     if (retval != 0) return retval;
 
-    retval = hal_pin_float_newf(HAL_OUT, &haldata->freq_cmd,
-                                hal_comp_id, "%s.frequency-command", modname);
+    retval = hal_pin_float_newf(HAL_OUT, &pins->min,
+                                hal_comp_id, "%s.%s.latency-min", prefix, name);
     if (retval != 0) return retval;
 
-    retval = hal_pin_float_newf(HAL_OUT, &haldata->output_freq,
-                                hal_comp_id, "%s.frequency-out", modname);
+    retval = hal_pin_float_newf(HAL_OUT, &pins->max,
+                                hal_comp_id, "%s.%s.latency-max", prefix, name);
     if (retval != 0) return retval;
 
-    retval = hal_pin_float_newf(HAL_OUT, &haldata->output_current,
-                                hal_comp_id, "%s.output-current", modname);
+    retval = hal_pin_float_newf(HAL_OUT, &pins->avg,
+                                hal_comp_id, "%s.%s.latency-avg", prefix, name);
     if (retval != 0) return retval;
 
-    retval = hal_pin_float_newf(HAL_OUT, &haldata->output_volt,
-                                hal_comp_id, "%s.output-volt", modname);
+    retval = hal_pin_s32_newf(HAL_OUT, &pins->count,
+                              hal_comp_id, "%s.%s.count", prefix, name);
     if (retval != 0) return retval;
 
-    retval = hal_pin_s32_newf(HAL_OUT, &haldata->dc_bus_volt,
-                              hal_comp_id, "%s.DC-bus-volt", modname);
-    if (retval != 0) return retval;
+    for (bucket = 0; bucket < NUM_LATENCY_BUCKETS - 1; bucket++) {
+        retval = hal_pin_s32_newf(HAL_OUT, &pins->histogram[bucket],
+                                  hal_comp_id, "%s.%s.under-%dms", prefix, name,
+                                  (int) lround(latency_bucket_limits[bucket] * 1000));
+        if (retval != 0) return retval;
+    }
 
-    retval = hal_pin_float_newf(HAL_OUT, &haldata->motor_load,
-                                hal_comp_id, "%s.load-percentage", modname);
-    if (retval != 0) return retval;
+    retval = hal_pin_s32_newf(HAL_OUT, &pins->histogram[bucket],
+                              hal_comp_id, "%s.%s.over-%dms", prefix, name,
+                              (int) lround(latency_bucket_limits[bucket - 1] * 1000));
+    return retval;
+}
 
-    retval = hal_pin_s32_newf(HAL_OUT, &haldata->inverter_temp,
-                              hal_comp_id, "%s.inverter-temp", modname);
-    if (retval != 0) return retval;
+/**
+ * @brief Create HAL pins.
+ * @param haldata Information to and from, LinuxCNC.
+ * @param prefix Start of the pin names, the module name and drive number.
+ * @param hal_comp_id Component ID created by HAL.
+ * @return 0 on success, -1 on failure.
+ */
+static int hal_setup(struct haldata *haldata, const char *prefix,
+                     int hal_comp_id)
+{
+    const struct register_def *reg;
+    int retval, type, i;
+
+    for (i = 0; i < NUM_REGISTER_READ; i++) {
+        reg = &registers[i];
+        if (reg->type == HAL_FLOAT)
+            retval = hal_pin_float_newf(reg->dir, register_float_pin(haldata, reg),
+                                        hal_comp_id, "%s.%s", prefix, reg->pin);
+        else
+            retval = hal_pin_s32_newf(reg->dir, register_s32_pin(haldata, reg),
+                                      hal_comp_id, "%s.%s", prefix, reg->pin);
+        if (retval != 0) return retval;
+    }
 
     retval = hal_pin_bit_newf(HAL_OUT, &haldata->vfd_error,
-                              hal_comp_id, "%s.vfd-error", modname);
+                              hal_comp_id, "%s.vfd-error", prefix);
     if (retval != 0) return retval;
 
     retval = hal_pin_bit_newf(HAL_OUT, &haldata->at_speed,
-                              hal_comp_id, "%s.at-speed", modname);
+                              hal_comp_id, "%s.at-speed", prefix);
     if (retval != 0) return retval;
 
     retval = hal_pin_bit_newf(HAL_OUT, &haldata->is_stopped,
-                              hal_comp_id, "%s.is-stopped", modname);
+                              hal_comp_id, "%s.is-stopped", prefix);
     if (retval != 0) return retval;
 
     retval = hal_pin_float_newf(HAL_OUT, &haldata->speed_fb,
-                                hal_comp_id, "%s.spindle-speed-fb", modname);
+                                hal_comp_id, "%s.spindle-speed-fb", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_float_newf(HAL_OUT, &haldata->read_time,
+                                hal_comp_id, "%s.last-read-time", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_float_newf(HAL_OUT, &haldata->telemetry_age,
+                                hal_comp_id, "%s.telemetry-age", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_bit_newf(HAL_OUT, &haldata->telemetry_stale,
+                              hal_comp_id, "%s.telemetry-stale", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_bit_newf(HAL_OUT, &haldata->predicted_at_speed,
+                              hal_comp_id, "%s.predicted-at-speed", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_float_newf(HAL_OUT, &haldata->time_to_at_speed,
+                                hal_comp_id, "%s.time-to-at-speed", prefix);
     if (retval != 0) return retval;
 
     retval = hal_pin_bit_newf(HAL_IN, &haldata->spindle_on,
-                              hal_comp_id, "%s.spindle-on", modname);
+                              hal_comp_id, "%s.spindle-on", prefix);
     if (retval != 0) return retval;
 
     retval = hal_pin_bit_newf(HAL_IN, &haldata->spindle_fwd,
-                              hal_comp_id, "%s.spindle-fwd", modname);
+                              hal_comp_id, "%s.spindle-fwd", prefix);
     if (retval != 0) return retval;
 
     retval = hal_pin_bit_newf(HAL_IN, &haldata->spindle_rev,
-                              hal_comp_id, "%s.spindle-rev", modname);
+                              hal_comp_id, "%s.spindle-rev", prefix);
     if (retval != 0) return retval;
 
     retval = hal_pin_float_newf(HAL_IN, &haldata->speed_cmd,
-                                hal_comp_id, "%s.speed-command", modname);
+                                hal_comp_id, "%s.speed-command", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_s32_newf(HAL_OUT, &haldata->suppressed_writes,
+                              hal_comp_id, "%s.suppressed-writes", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_float_newf(HAL_OUT, &haldata->cycle_time,
+                                hal_comp_id, "%s.cycle-time", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_float_newf(HAL_OUT, &haldata->max_cycle_time,
+                                hal_comp_id, "%s.max-cycle-time", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_s32_newf(HAL_OUT, &haldata->overruns,
+                              hal_comp_id, "%s.overruns", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_float_newf(HAL_OUT, &haldata->wakeup_jitter,
+                                hal_comp_id, "%s.wakeup-jitter", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_float_newf(HAL_OUT, &haldata->max_wakeup_jitter,
+                                hal_comp_id, "%s.max-wakeup-jitter", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_s32_newf(HAL_OUT, &haldata->breaker_state,
+                              hal_comp_id, "%s.breaker-state", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_bit_newf(HAL_OUT, &haldata->comm_ok,
+                              hal_comp_id, "%s.comm-ok", prefix);
+    if (retval != 0) return retval;
+
+    for (type = 0; type < NUM_LATENCY_TYPES; type++) {
+        retval = latency_pins_setup(&haldata->latency[type], prefix,
+                                    latency_names[type], hal_comp_id);
+        if (retval != 0) return retval;
+    }
+
+    retval = hal_pin_bit_newf(HAL_IO, &haldata->reset_stats,
+                              hal_comp_id, "%s.reset-stats", prefix);
     if (retval != 0) return retval;
 
     retval = hal_param_float_newf(HAL_RW, &haldata->speed_tolerance,
-                                  hal_comp_id, "%s.tolerance", modname);
+                                  hal_comp_id, "%s.tolerance", prefix);
     if (retval != 0) return retval;
 
     retval = hal_param_float_newf(HAL_RW, &haldata->period,
-                                  hal_comp_id, "%s.period-seconds", modname);
+                                  hal_comp_id, "%s.period-seconds", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_param_float_newf(HAL_RW, &haldata->slow_period,
+                                  hal_comp_id, "%s.slow-period-seconds", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_param_float_newf(HAL_RW, &haldata->hal_period,
+                                  hal_comp_id, "%s.hal-period-seconds", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_param_float_newf(HAL_RW, &haldata->response_timeout,
+                                  hal_comp_id, "%s.response-timeout-seconds", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_param_float_newf(HAL_RW, &haldata->byte_timeout,
+                                  hal_comp_id, "%s.byte-timeout-seconds", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_param_float_newf(HAL_RO, &haldata->turnaround,
+                                  hal_comp_id, "%s.turnaround-seconds", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_param_float_newf(HAL_RW, &haldata->stale_limit,
+                                  hal_comp_id, "%s.stale-limit-seconds", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_param_float_newf(HAL_RW, &haldata->max_extrapolation,
+                                  hal_comp_id, "%s.max-extrapolation-seconds", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_param_float_newf(HAL_RO, &haldata->accel,
+                                  hal_comp_id, "%s.acceleration", prefix);
+    if (retval != 0) return retval;
+
+    retval = hal_param_float_newf(HAL_RO, &haldata->decel,
+                                  hal_comp_id, "%s.deceleration", prefix);
     if (retval != 0) return retval;
 
     retval = hal_param_s32_newf(HAL_RO, &haldata->modbus_errors,
-                                hal_comp_id, "%s.modbus-errors", modname);
+                                hal_comp_id, "%s.modbus-errors", prefix);
+    if (retval != 0) return retval;
+
+    return retval;
+}
+
+/**
+ * @brief Create the HAL pins shared by all vfds, in broadcast mode.
+ * @param group Pins to create.
+ * @param hal_comp_id Component ID created by HAL.
+ * @return 0 on success, -1 on failure.
+ */
+static int hal_group_setup(struct hal_group *group, int hal_comp_id)
+{
+    int retval;
+
+    retval = hal_pin_bit_newf(HAL_IN, &group->spindle_on,
+                              hal_comp_id, "%s.group.spindle-on", modname);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_bit_newf(HAL_IN, &group->spindle_fwd,
+                              hal_comp_id, "%s.group.spindle-fwd", modname);
+    if (retval != 0) return retval;
+
+    retval = hal_pin_bit_newf(HAL_IN, &group->spindle_rev,
+                              hal_comp_id, "%s.group.spindle-rev", modname);
     if (retval != 0) return retval;
 
+    retval = hal_pin_bit_newf(HAL_OUT, &group->confirmed,
+                              hal_comp_id, "%s.group.confirmed", modname);
     return retval;
 }
 
+/**
+ * @brief Give pins and parameters of one vfd their initial values.
+ * @param haldata Information to and from, LinuxCNC.
+ * @param vfd Connection to vfd.
+ */
+static void hal_defaults(struct haldata *haldata, const struct vfd *vfd)
+{
+    int i;
+
+    /* Make default data match what we expect to use */
+    for (i = 0; i < NUM_REGISTER_READ; i++)
+        set_register_pin(haldata, &registers[i], 0);
+    *haldata->vfd_error = 0;
+
+    *haldata->at_speed = 0;
+    *haldata->is_stopped = 0;
+    *haldata->read_time = 0.0;
+    *haldata->telemetry_age = 0.0;
+    *haldata->telemetry_stale = 0;
+    *haldata->predicted_at_speed = 0;
+    *haldata->time_to_at_speed = 0.0;
+    memset(&haldata->ramp, 0, sizeof(haldata->ramp));
+    *haldata->speed_cmd = 0;
+    *haldata->suppressed_writes = 0;
+    *haldata->cycle_time = 0.0;
+    *haldata->max_cycle_time = 0.0;
+    *haldata->wakeup_jitter = 0.0;
+    *haldata->max_wakeup_jitter = 0.0;
+    *haldata->overruns = 0;
+    *haldata->breaker_state = BREAKER_CLOSED;
+    *haldata->comm_ok = 0;
+    *haldata->reset_stats = 0;
+    haldata->reset_count = 0;
+
+    haldata->speed_tolerance = 0.01;
+    haldata->period = 0.1;
+    haldata->slow_period = 1.0;
+    haldata->hal_period = 0.001;
+    haldata->response_timeout = vfd->response_timeout;
+    haldata->byte_timeout = vfd->byte_timeout;
+    haldata->turnaround = vfd->turnaround;
+    haldata->stale_limit = 0.0;
+    haldata->max_extrapolation = 0.0;
+    haldata->accel = 0.0;
+    haldata->decel = 0.0;
+    haldata->modbus_errors = 0;
+}
+
 int main(int argc, char **argv)
 {
     struct haldata *haldata;
-    struct timespec period_timespec;
+    struct vfd config;              /*!< settings shared by all vfds */
+    struct vfd *vfd;
+    struct vfd_bus buses[MAX_BUSES];
+    struct vfd_bus *bus;
+    struct vfd_exchange *exchange = NULL;
 
-    modbus_t *mb_ctx;
-    char *device;
     char parity;
     int baud;
     int bits;
     int stopbits;
-    int target;
+    int targets[MAX_BUSES][MAX_VFDS];
+    int num_targets[MAX_BUSES];
+    int num_buses;
+    int device_given;
+    int num_vfds;
+    size_t name_len;
+    int num_threads;
     int verbose;
+    int threaded;
+    int event_driven;
+    int broadcast;
+    int native_rtu;
+    int low_latency;
+    int by_id;
+    int latency_timer;
+    enum rs485_mode rs485_mode;
+    double rts_delay;
+    int priority;
+    int lock_memory;
+    int cpu;
+    struct hal_group *group = NULL;
+    unsigned int fast_mask;
+    double response_timeout = -1.0;
+    double byte_timeout = -1.0;
 
     int retval = 0;
     int hal_comp_id;
     double spindle_max_speed = 24000.0;
     double max_freq = 400.0;
-    double hzcalc;
 
     char *endarg;
     int opt;
     int argindex, argvalue;
+    int b, i, n;
 
     done = 0;
+    memset(&config, 0, sizeof(config));
+    memset(buses, 0, sizeof(buses));
+    for (b = 0; b < MAX_BUSES; b++)
+        buses[b].event_fd = -1;
 
     /* Assume that nothing is specified on the command line */
-    device = "/dev/ttyUSB0";
+    buses[0].device = "/dev/ttyUSB0";
+    num_buses = 1;
+    device_given = 0;
     baud = 19200;
     bits = 8;
     parity = 'N';
     stopbits = 1;
 
     verbose = 0;
+    threaded = 0;
+    event_driven = 0;
+    broadcast = 0;
+    native_rtu = 0;
+    low_latency = 0;
+    by_id = 0;
+    rs485_mode = RS485_NONE;
+    rts_delay = -1;
+    priority = 0;
+    lock_memory = 0;
+    cpu = -1;
+    fast_mask = 0;
+    for (i = 0; i < NUM_REGISTER_READ; i++) {
+        if (registers[i].group == POLL_FAST)
+            fast_mask |= 1u << i;
+    }
+    if (check_registers(fast_mask) != 0) {
+        retval = -1;
+        goto out_noclose;
+    }
+    config.combined_rw = COMBINED_RW_OFF;
+    config.policy.budget[OP_READ] = NUM_READ_RETRIES;
+    config.policy.budget[OP_READ_SLOW] = NUM_READ_RETRIES;
+    config.policy.budget[OP_WRITE] = NUM_WRITE_RETRIES;
+    config.policy.delay = RETRY_DELAY;
+    config.policy.breaker_threshold = BREAKER_THRESHOLD;
+    config.policy.probe_period = PROBE_PERIOD;
 
-    target = 1;
+    memset(num_targets, 0, sizeof(num_targets));
 
     /* Process command line options */
     while ((opt = getopt_long(argc, argv, option_string, long_options, NULL)) != -1) {
@@ -442,17 +3859,22 @@ int main(int argc, char **argv)
                     retval = -1;
                     goto out_noclose;
                 }
-                device = strdup(optarg);
+                /* Each device after the first one is a new bus */
+                if (device_given) {
+                    if (num_buses == MAX_BUSES) {
+                        fprintf(stderr, "ERROR: more than %d devices\n",
+                                MAX_BUSES);
+                        retval = -1;
+                        goto out_noclose;
+                    }
+                    num_buses++;
+                }
+                buses[num_buses - 1].device = optarg;
+                device_given = 1;
                 break;
             /* Module base name */
             case 'n':
-                if (strlen(optarg) > HAL_NAME_LEN - 20) {
-                    fprintf(stderr, "ERROR: HAL module name to long: %s\n",
-                            optarg);
-                    retval = -1;
-                    goto out_noclose;
-                }
-                modname = strdup(optarg);
+                modname = optarg;
                 break;
             /* Parity, should be a string like "even", "odd" or "none" */
             case 'p':
@@ -483,7 +3905,17 @@ int main(int argc, char **argv)
                     retval = -1;
                     goto out_noclose;
                 }
-                target = argvalue;
+                /* Targets belong to the device given before them */
+                b = num_buses - 1;
+                for (i = 0; i < num_targets[b]; i++) {
+                    if (targets[b][i] == argvalue) {
+                        fprintf(stderr, "ERROR: target number given twice: %s\n",
+                                optarg);
+                        retval = -1;
+                        goto out_noclose;
+                    }
+                }
+                targets[b][num_targets[b]++] = argvalue;
                 break;
             case 'S':
                 spindle_max_speed = strtod(optarg, &endarg);
@@ -506,6 +3938,141 @@ int main(int argc, char **argv)
             case 'v':
                 verbose = 1;
                 break;
+            case OPT_COMBINED_RW:
+                config.combined_rw = COMBINED_RW_PROBE;
+                break;
+            case OPT_THREADED:
+                threaded = 1;
+                break;
+            case OPT_EVENT_DRIVEN:
+                event_driven = 1;
+                threaded = 1;
+                break;
+            case OPT_BROADCAST:
+                broadcast = 1;
+                break;
+            case OPT_NATIVE_RTU:
+                native_rtu = 1;
+                break;
+            case OPT_LOW_LATENCY:
+                low_latency = 1;
+                break;
+            case OPT_BY_ID:
+                by_id = 1;
+                break;
+            case OPT_RS485:
+                if (strcmp(optarg, "kernel") == 0) {
+                    rs485_mode = RS485_KERNEL;
+                } else if (strcmp(optarg, "rts") == 0) {
+                    rs485_mode = RS485_RTS_UP;
+                } else if (strcmp(optarg, "rts-down") == 0) {
+                    rs485_mode = RS485_RTS_DOWN;
+                } else {
+                    fprintf(stderr, "%s: ERROR: invalid RS485 mode: %s\n",
+                            modname, optarg);
+                    retval = -1;
+                    goto out_noclose;
+                }
+                break;
+            case OPT_PRIORITY:
+                priority = strtol(optarg, &endarg, 10);
+                if ((*endarg != '\0') || priority < sched_get_priority_min(SCHED_FIFO) ||
+                    priority > sched_get_priority_max(SCHED_FIFO)) {
+                    fprintf(stderr, "%s: ERROR: invalid priority: %s\n",
+                            modname, optarg);
+                    retval = -1;
+                    goto out_noclose;
+                }
+                break;
+            case OPT_LOCK_MEMORY:
+                lock_memory = 1;
+                break;
+            case OPT_CPU:
+                cpu = strtol(optarg, &endarg, 10);
+                if ((*endarg != '\0') || cpu < 0 || cpu >= CPU_SETSIZE) {
+                    fprintf(stderr, "%s: ERROR: invalid CPU: %s\n",
+                            modname, optarg);
+                    retval = -1;
+                    goto out_noclose;
+                }
+                break;
+            case OPT_RTS_DELAY:
+                rts_delay = strtod(optarg, &endarg);
+                if ((*endarg != '\0') || rts_delay < 0 || rts_delay > 1) {
+                    fprintf(stderr, "%s: ERROR: invalid RTS delay: %s\n",
+                            modname, optarg);
+                    retval = -1;
+                    goto out_noclose;
+                }
+                break;
+            case OPT_FAST_REGISTERS:
+                if (parse_register_list(optarg, &fast_mask) != 0) {
+                    fprintf(stderr, "%s: ERROR: invalid list of registers: %s\n",
+                            modname, optarg);
+                    retval = -1;
+                    goto out_noclose;
+                }
+                break;
+            case OPT_READ_RETRIES:
+            case OPT_WRITE_RETRIES:
+                argvalue = strtol(optarg, &endarg, 10);
+                if ((*endarg != '\0') || (argvalue < 0) || (argvalue > 100)) {
+                    fprintf(stderr, "%s: ERROR: invalid number of retries: %s\n",
+                            modname, optarg);
+                    retval = -1;
+                    goto out_noclose;
+                }
+                if (opt == OPT_WRITE_RETRIES) {
+                    config.policy.budget[OP_WRITE] = argvalue;
+                } else {
+                    config.policy.budget[OP_READ] = argvalue;
+                    config.policy.budget[OP_READ_SLOW] = argvalue;
+                }
+                break;
+            case OPT_RETRY_DELAY:
+                config.policy.delay = strtod(optarg, &endarg);
+                if ((*endarg != '\0') || (config.policy.delay < 0.0)) {
+                    fprintf(stderr, "%s: ERROR: invalid retry delay: %s\n",
+                            modname, optarg);
+                    retval = -1;
+                    goto out_noclose;
+                }
+                break;
+            case OPT_BREAKER_THRESHOLD:
+                argvalue = strtol(optarg, &endarg, 10);
+                if ((*endarg != '\0') || (argvalue < 1)) {
+                    fprintf(stderr, "%s: ERROR: invalid breaker threshold: %s\n",
+                            modname, optarg);
+                    retval = -1;
+                    goto out_noclose;
+                }
+                config.policy.breaker_threshold = argvalue;
+                break;
+            case OPT_PROBE_PERIOD:
+                config.policy.probe_period = strtod(optarg, &endarg);
+                if ((*endarg != '\0') || (config.policy.probe_period <= 0.0)) {
+                    fprintf(stderr, "%s: ERROR: invalid probe period: %s\n",
+                            modname, optarg);
+                    retval = -1;
+                    goto out_noclose;
+                }
+                break;
+            case OPT_RESPONSE_TIMEOUT:
+            case OPT_BYTE_TIMEOUT:
+                if (opt == OPT_RESPONSE_TIMEOUT) {
+                    response_timeout = strtod(optarg, &endarg);
+                    argvalue = response_timeout < 0.001 || response_timeout > 10.0;
+                } else {
+                    byte_timeout = strtod(optarg, &endarg);
+                    argvalue = byte_timeout < 0.0001 || byte_timeout > 1.0;
+                }
+                if ((*endarg != '\0') || argvalue) {
+                    fprintf(stderr, "%s: ERROR: invalid timeout: %s\n",
+                            modname, optarg);
+                    retval = -1;
+                    goto out_noclose;
+                }
+                break;
             case 'h':
                 usage(argv);
                 exit(0);
@@ -517,34 +4084,145 @@ int main(int argc, char **argv)
         }
     }
 
-    printf("%s: device='%s', baud='%d', bits=%d, parity='%c', stopbits=%d, address=%d\n",
-            modname, device, baud, bits, parity, stopbits, target);
+    /* Target number (MODBUS ID), default 1 */
+    num_vfds = 0;
+    for (b = 0; b < num_buses; b++) {
+        if (num_targets[b] == 0)
+            targets[b][num_targets[b]++] = 1;
+        num_vfds += num_targets[b];
+    }
+
+    /* With several vfds, their pins are numbered after the module name */
+    name_len = strlen(modname) + strlen(LONGEST_PIN_SUFFIX);
+    if (num_vfds > 1)
+        name_len += snprintf(NULL, 0, ".%d", num_vfds - 1);
+    if (name_len > HAL_NAME_LEN) {
+        fprintf(stderr, "ERROR: HAL module name to long: %s\n", modname);
+        retval = -1;
+        goto out_noclose;
+    }
+
+    /* A blocked bus must not hold up the others, each gets a thread */
+    if (num_buses > 1)
+        threaded = 1;
 
     /*
      * Point TERM and INT signals at our quit function.
      * If a signal is received between here and the main loop, it should
      * prevent some initialization from happening.
      */
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd < 0) {
+        fprintf(stderr, "%s: ERROR: unable to create eventfd: %s\n",
+                modname, strerror(errno));
+        retval = -1;
+        goto out_noclose;
+    }
     signal(SIGINT, quit);
     signal(SIGTERM, quit);
 
-    /* Assume 19200 bps 8-N-1 serial setting, device 1 */
-    mb_ctx = modbus_new_rtu(device, baud, parity, bits, stopbits);
-    if (mb_ctx == NULL) {
-        fprintf(stderr, "%s: ERROR: Couldn't open modbus serial device: %s\n",
-                modname, modbus_strerror(errno));
+    exchange = calloc(num_vfds, sizeof(*exchange));
+    if (exchange == NULL) {
+        fprintf(stderr, "%s: ERROR: out of memory\n", modname);
+        retval = -1;
         goto out_noclose;
     }
 
-    retval = modbus_connect(mb_ctx);
-    if (retval != 0) {
-        fprintf(stderr, "%s: ERROR: Couldn't open serial device: %s\n",
-                modname, modbus_strerror(errno));
-        goto out_noclose;
-    }
+    n = 0;
+    for (b = 0; b < num_buses; b++) {
+        bus = &buses[b];
+        if (by_id) {
+            if (find_stable_device(bus->device, bus->stable_device,
+                                   sizeof(bus->stable_device)) == 0)
+                bus->device = bus->stable_device;
+            else
+                fprintf(stderr, "%s: WARNING: no link to %s in %s, it may not be found when reconnecting\n",
+                        modname, bus->device, SERIAL_BY_ID);
+        }
+        printf("%s: device='%s', baud='%d', bits=%d, parity='%c', stopbits=%d\n",
+                modname, bus->device, baud, bits, parity, stopbits);
+
+        /* Assume 19200 bps 8-N-1 serial setting, device 1 */
+        bus->mb_ctx = modbus_new_rtu(bus->device, baud, parity, bits, stopbits);
+        if (bus->mb_ctx == NULL) {
+            fprintf(stderr, "%s: ERROR: Couldn't open modbus serial device: %s\n",
+                    modname, modbus_strerror(errno));
+            retval = -1;
+            goto out_close;
+        }
+
+        if (native_rtu) {
+            bus->rtu = calloc(1, sizeof(*bus->rtu));
+            if (bus->rtu == NULL) {
+                fprintf(stderr, "%s: ERROR: out of memory\n", modname);
+                retval = -1;
+                goto out_close;
+            }
+        }
+
+        bus->char_time = get_char_time(baud, parity, bits, stopbits);
+        bus->verbose = verbose;
+        bus->rs485_mode = rs485_mode;
+        bus->rts_delay = rts_delay;
+        bus->low_latency = low_latency;
+        if (connect_bus(bus, 1) != 0) {
+            retval = -1;
+            goto out_close;
+        }
+
+        latency_timer = get_latency_timer(bus->device);
+        if (latency_timer >= 0)
+            printf("%s: latency timer of %s is %d ms\n", modname, bus->device,
+                   latency_timer);
+
+        bus->num_vfds = num_targets[b];
+        bus->broadcast = broadcast;
+        bus->priority = priority;
+        bus->cpu = cpu;
+        bus->vfd = calloc(bus->num_vfds, sizeof(*bus->vfd));
+        if (bus->vfd == NULL) {
+            fprintf(stderr, "%s: ERROR: out of memory\n", modname);
+            retval = -1;
+            goto out_close;
+        }
+
+        for (i = 0; i < bus->num_vfds; i++, n++) {
+            vfd = &bus->vfd[i];
+            *vfd = config;
+            vfd->bus = bus;
+            vfd->target = targets[b][i];
+            setup_poll_groups(vfd, fast_mask);
+            if (threaded)
+                vfd->exchange = &exchange[n];
 
-    modbus_set_debug(mb_ctx, verbose);
-    modbus_set_slave(mb_ctx, target);
+            /* Keep the old pin names, when there is only one vfd */
+            if (num_vfds == 1)
+                snprintf(vfd->name, sizeof(vfd->name), "%s", modname);
+            else
+                snprintf(vfd->name, sizeof(vfd->name), "%s.%d", modname, n);
+
+            /* Find timeouts that suits the baud rate and the vfd */
+            bus_set_slave(bus, vfd->target);
+            vfd->char_time = get_char_time(baud, parity, bits, stopbits);
+            if (low_latency && i == 0)
+                apply_low_latency(bus, vfd);
+            vfd->turnaround = measure_turnaround(vfd);
+            if (vfd->turnaround < 0) {
+                fprintf(stderr, "%s: WARNING: no answer from vfd, assuming a turnaround of %g s\n",
+                        vfd->name, DEFAULT_TURNAROUND);
+                vfd->turnaround = DEFAULT_TURNAROUND;
+            }
+            compute_timeouts(vfd, &vfd->response_timeout, &vfd->byte_timeout);
+            if (response_timeout > 0)
+                vfd->response_timeout = response_timeout;
+            if (byte_timeout > 0)
+                vfd->byte_timeout = byte_timeout;
+            set_timeouts(vfd, vfd->response_timeout, vfd->byte_timeout);
+            printf("%s: address=%d, turnaround %.1f ms, response timeout %.1f ms, byte timeout %.1f ms\n",
+                   vfd->name, vfd->target, vfd->turnaround * 1000,
+                   vfd->response_timeout * 1000, vfd->byte_timeout * 1000);
+        }
+    }
 
     /* Create HAL component */
     hal_comp_id = hal_init(modname);
@@ -554,65 +4232,130 @@ int main(int argc, char **argv)
         goto out_close;
     }
 
-    haldata = hal_malloc(sizeof(struct haldata));
-    if (haldata == NULL) {
-        fprintf(stderr, "%s: ERROR: unable to allocate shared memory\n",
-                modname);
-        retval = -1;
-        goto out_closeHAL;
-    }
+    if (broadcast) {
+        group = hal_malloc(sizeof(struct hal_group));
+        if (group == NULL) {
+            fprintf(stderr, "%s: ERROR: unable to allocate shared memory\n",
+                    modname);
+            retval = -1;
+            goto out_closeHAL;
+        }
 
-    if (hal_setup(haldata, hal_comp_id)) {
-        retval = -1;
-        goto out_closeHAL;
+        if (hal_group_setup(group, hal_comp_id)) {
+            retval = -1;
+            goto out_closeHAL;
+        }
+        *group->spindle_on = 0;
+        *group->spindle_fwd = 0;
+        *group->spindle_rev = 0;
+        *group->confirmed = 0;
     }
 
-    /* Make default data match what we expect to use */
-    *haldata->inverter_status = 0;
-    *haldata->freq_cmd = 0.0;
-    *haldata->output_freq = 0.0;
-    *haldata->output_current = 0.0;
-    *haldata->output_volt = 0.0;
-    *haldata->dc_bus_volt = 0;
-    *haldata->motor_load = 0.0;
-    *haldata->inverter_temp = 0;
-    *haldata->vfd_error = 0;
+    for (b = 0; b < num_buses; b++) {
+        for (i = 0; i < buses[b].num_vfds; i++) {
+            vfd = &buses[b].vfd[i];
+            haldata = hal_malloc(sizeof(struct haldata));
+            if (haldata == NULL) {
+                fprintf(stderr, "%s: ERROR: unable to allocate shared memory\n",
+                        modname);
+                retval = -1;
+                goto out_closeHAL;
+            }
 
-    *haldata->at_speed = 0;
-    *haldata->is_stopped = 0;
-    *haldata->speed_cmd = 0;
+            if (hal_setup(haldata, vfd->name, hal_comp_id)) {
+                retval = -1;
+                goto out_closeHAL;
+            }
+            hal_defaults(haldata, vfd);
+            haldata->group = group;
+            vfd->haldata = haldata;
+        }
+    }
 
-    haldata->speed_tolerance = 0.01;
-    haldata->period = 0.1;
-    haldata->modbus_errors = 0;
+    /* Page faults in the I/O loop would show up as jitter */
+    if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        if (errno == EPERM || errno == ENOMEM)
+            fprintf(stderr, "%s: WARNING: not allowed to lock memory, run as root, or raise memlock in /etc/security/limits.conf\n",
+                    modname);
+        else
+            fprintf(stderr, "%s: WARNING: couldn't lock memory: %s\n",
+                    modname, strerror(errno));
+    }
 
     /* Activate HAL component */
     hal_ready(hal_comp_id);
 
-    /* Calculate frequency */
-    hzcalc = max_freq / spindle_max_speed;
+    for (b = 0; b < num_buses; b++) {
+        for (i = 0; i < buses[b].num_vfds; i++) {
+            vfd = &buses[b].vfd[i];
 
-    while (done == 0) {
-        /* Don't scan to fast, and not delay more than a few seconds */
-        if (haldata->period < 0.001) haldata->period = 0.001;
-        if (haldata->period > 2.0) haldata->period = 2.0;
-        period_timespec.tv_sec = (time_t)(haldata->period);
-        period_timespec.tv_nsec = (long)((haldata->period - period_timespec.tv_sec) * 1000000000l);
-        nanosleep(&period_timespec, NULL);
+            /* Calculate frequency */
+            vfd->freq_calc = max_freq / spindle_max_speed;
+            vfd->max_freq = max_freq;
+            sample_command(vfd->haldata, &vfd->cmd);
+
+            if (vfd->exchange) {
+                triple_buffer_init(&vfd->exchange->cmd_buffer);
+                triple_buffer_init(&vfd->exchange->telemetry_buffer);
+                vfd->exchange->last_cmd = vfd->cmd;
+            }
+        }
+
+        if (event_driven) {
+            buses[b].event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (buses[b].event_fd < 0) {
+                fprintf(stderr, "%s: ERROR: unable to create eventfd: %s\n",
+                        modname, strerror(errno));
+                retval = -1;
+                goto out_closeHAL;
+            }
+        }
+    }
 
-        read_data(mb_ctx, haldata);
-        write_data(mb_ctx, haldata, hzcalc, max_freq);
+    if (threaded) {
+        for (num_threads = 0; num_threads < num_buses; num_threads++) {
+            bus = &buses[num_threads];
+            retval = pthread_create(&bus->thread, NULL, io_thread, bus);
+            if (retval != 0) {
+                fprintf(stderr, "%s: ERROR: unable to start I/O thread: %s\n",
+                        modname, strerror(retval));
+                done = 1;
+                break;
+            }
+        }
+        if (!done)
+            hal_loop(buses, num_buses);
+        for (b = 0; b < num_threads; b++)
+            pthread_join(buses[b].thread, NULL);
+        if (retval != 0) {
+            retval = -1;
+            goto out_closeHAL;
+        }
+    } else {
+        io_loop(&buses[0]);
     }
 
+    /* Don't leave the spindle running at the last command */
+    stop_vfds(buses, num_buses);
+
     /* If we get here, then everything is fine, so just clean up and exit */
     retval = 0;
 out_closeHAL:
     hal_exit(hal_comp_id);
 out_close:
-    modbus_close(mb_ctx);
-    modbus_free(mb_ctx);
+    for (b = 0; b < num_buses; b++) {
+        if (buses[b].event_fd >= 0)
+            close(buses[b].event_fd);
+        if (buses[b].mb_ctx) {
+            modbus_close(buses[b].mb_ctx);
+            modbus_free(buses[b].mb_ctx);
+        }
+        free(buses[b].rtu);
+        free(buses[b].vfd);
+    }
 out_noclose:
-    free(device);
-    free(modname);
+    free(exchange);
+    if (stop_fd >= 0)
+        close(stop_fd);
     return retval;
 }